@@ -171,6 +171,41 @@ void listDelNode(list *list, listNode *node)
     list->len--;
 }
 
+/* Remove up to 'count' nodes from the head of the list, or from the tail
+ * when direction is AL_START_TAIL, relinking the list only once. The
+ * values are handed in removal order to 'take', that becomes their owner,
+ * or freed with the free method of the list when 'take' is NULL.
+ *
+ * Returns the number of nodes removed. */
+unsigned long listDelRange(list *list, int direction, unsigned long count,
+                           void (*take)(void *privdata, void *value),
+                           void *privdata)
+{
+    listNode *node, *next;
+    unsigned long j;
+
+    if (count > list->len) count = list->len;
+    node = (direction == AL_START_HEAD) ? list->head : list->tail;
+    for (j = 0; j < count; j++) {
+        next = (direction == AL_START_HEAD) ? node->next : node->prev;
+        if (take) take(privdata,node->value);
+        else if (list->free) list->free(node->value);
+        zfree(node);
+        node = next;
+    }
+    if (direction == AL_START_HEAD) {
+        list->head = node;
+        if (node) node->prev = NULL;
+        else list->tail = NULL;
+    } else {
+        list->tail = node;
+        if (node) node->next = NULL;
+        else list->head = NULL;
+    }
+    list->len -= count;
+    return count;
+}
+
 /* Returns a list iterator 'iter'. After the initialization every
  * call to listNext() will return the next element of the list.
  *
@@ -76,6 +76,9 @@ list *listAddNodeHead(list *list, void *value);
 list *listAddNodeTail(list *list, void *value);
 list *listInsertNode(list *list, listNode *old_node, void *value, int after);
 void listDelNode(list *list, listNode *node);
+unsigned long listDelRange(list *list, int direction, unsigned long count,
+                           void (*take)(void *privdata, void *value),
+                           void *privdata);
 listIter *listGetIterator(list *list, int direction);
 listNode *listNext(listIter *iter);
 void listReleaseIterator(listIter *iter);
@@ -136,7 +136,13 @@ struct redisCommand readonlyCommandTable[] = {
 #define ZREVRANGEWITHSCORE_COMMAND 64
     {"zrevrangewithscore",zrevrangewithscoreCommand,4,0},
 #define SETNXEX_COMMAND 65
-    {"setnxex",setnxexCommand,4,REDIS_CMD_DENYOOM}
+    {"setnxex",setnxexCommand,4,REDIS_CMD_DENYOOM},
+#define MGET_COMMAND 66
+    {"mget",mgetCommand,2,0},
+#define PEXPIRE_COMMAND 67
+    {"pexpire",pexpireCommand,3,0},
+#define PTTL_COMMAND 68
+    {"pttl",pttlCommand,2,0}
 };
 
 #define getCommand(cmd) (&readonlyCommandTable[cmd])
@@ -55,6 +55,13 @@
 #define HAVE_KQUEUE 1
 #endif
 
+/* test for __sync atomic builtins (gcc >= 4.1 on x86) */
+#if (defined(__i386) || defined(__amd64) || defined(__x86_64__)) && defined(__GNUC__)
+#if (__GNUC__ * 100 + __GNUC_MINOR__) >= 401
+#define HAVE_ATOMIC 1
+#endif
+#endif
+
 /* define aof_fsync to fdatasync() in Linux and fsync() for all the rest */
 #ifdef __linux__
 #define aof_fsync fdatasync
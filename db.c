@@ -2,6 +2,34 @@
 
 #include <signal.h>
 
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de);
+
+/* Record an access to a value for the maxmemory policy of the db */
+static void touchObject(redisDb *db, robj *val) {
+    if (REDIS_MAXMEMORY_IS_LFU(db->maxmemory_policy))
+        updateObjectLFU(val);
+    else
+        val->lru = shared.lruclock;
+}
+
+/* Interior nodes of a compressed quicklist that earlier commands had to
+ * decompress are compressed again, unless a reply still points into them. */
+static void recompressObject(robj *val) {
+    if (val->encoding == REDIS_ENCODING_QUICKLIST && val->refcount == 1)
+        quicklistRecompress(val->ptr);
+}
+
+/* Set up the access information of a value stored at a key: a new key
+ * starts with the initial LFU counter, an overwritten one inherits the
+ * counter of the old value. */
+static void initObjectAccess(redisDb *db, robj *val, dictEntry *old) {
+    if (!REDIS_MAXMEMORY_IS_LFU(db->maxmemory_policy)) return;
+    if (old)
+        val->lru = ((robj*)dictGetEntryVal(old))->lru;
+    else
+        initObjectLFU(val);
+}
+
 /*-----------------------------------------------------------------------------
  * C-level DB API
  *----------------------------------------------------------------------------*/
@@ -14,7 +42,8 @@ robj *lookupKeyWithVersion(redisDb *db, robj *key, uint16_t* version) {
 
         *version = sdsversion(key_tmp);
 
-        val->lru = shared.lruclock;
+        touchObject(db,val);
+        recompressObject(val);
         db->stat_keyspace_hits++;
         return val;
     } else {
@@ -29,12 +58,105 @@ robj *lookupKeyReadWithVersion(redisDb *db, robj *key, uint16_t *version) {
     return lookupKeyWithVersion(db,key,version);
 }
 
+/* Batched lookupKeyReadWithVersion(): vals[i] and versions[i] get what it
+ * would return for keys[i]. Keys are handled REDIS_LOOKUP_BATCH at a time:
+ * all of them are hashed and their buckets prefetched, then their entries,
+ * and only then resolved, so the cache misses of the keys of a batch overlap
+ * instead of being paid one after the other. db->dict and db->expires hash
+ * keys the same way, so one hash serves both. */
+void lookupKeysReadWithVersion(redisDb *db, robj **keys, int count,
+                               robj **vals, uint16_t *versions) {
+    unsigned int hash[REDIS_LOOKUP_BATCH];
+    int i, j, n, volatile_keys = dictSize(db->expires) != 0;
+
+    for (i = 0; i < count; i += n) {
+        n = count-i < REDIS_LOOKUP_BATCH ? count-i : REDIS_LOOKUP_BATCH;
+        for (j = 0; j < n; j++) {
+            hash[j] = dictGetHash(db->dict,keys[i+j]->ptr);
+            dictPrefetch(db->dict,hash[j],0);
+            if (volatile_keys) dictPrefetch(db->expires,hash[j],0);
+        }
+        for (j = 0; j < n; j++)
+            dictPrefetch(db->dict,hash[j],1);
+        for (j = 0; j < n; j++) {
+            robj *key = keys[i+j];
+            dictEntry *de = dictFindWithHash(db->dict,key->ptr,hash[j]);
+            robj *val = NULL;
+            sds skey;
+
+            versions[i+j] = 0;
+            if (de) {
+                /* Grab what we need, the entry may move on expire checks */
+                skey = dictGetEntryKey(de);
+                val = dictGetEntryVal(de);
+                if (expireEntryIfNeeded(db,key,de)) val = NULL;
+            }
+            if (val) {
+                versions[i+j] = sdsversion(skey);
+                touchObject(db,val);
+                recompressObject(val);
+                db->stat_keyspace_hits++;
+            } else {
+                db->stat_keyspace_misses++;
+            }
+            vals[i+j] = val;
+        }
+    }
+}
+
+/* Replies may pin a ziplist, zipmap or quicklist value to point straight
+ * into its memory (see pinValueItemList). Before such a value is modified
+ * in place give the key a private copy; the pinned one is released with
+ * the reply. */
+static robj *unshareCompactObject(redisDb *db, robj *key, robj *val) {
+    dictEntry *de;
+    robj *copy;
+    size_t len;
+
+    if (val->encoding == REDIS_ENCODING_ZIPLIST) {
+        len = ziplistSize(val->ptr);
+    } else if (val->encoding == REDIS_ENCODING_ZIPMAP) {
+        len = zipmapBlobLen(val->ptr);
+    } else if (val->encoding == REDIS_ENCODING_QUICKLIST) {
+        len = 0;
+    } else {
+        return val;
+    }
+    de = dictFind(db->dict,key->ptr);
+    redisAssert(de != NULL);
+    if (len) {
+        copy = createObject(val->type,zmalloc(len));
+        memcpy(copy->ptr,val->ptr,len);
+    } else {
+        copy = createObject(val->type,quicklistDup(val->ptr));
+    }
+    copy->encoding = val->encoding;
+    copy->lru = val->lru;
+    dictGetEntryVal(de) = copy;
+    decrRefCount(val);
+    return copy;
+}
+
 robj *lookupKeyWriteWithVersion(redisDb *db, robj *key, uint16_t *version) {
     *version = 0;
     expireIfNeeded(db,key);
     return lookupKeyWithVersion(db,key,version);
 }
 
+/* Lookup for commands that modify a ziplist, zipmap or quicklist value of
+ * the given type in place: such a value pinned by a reply is first replaced
+ * by a private copy. A value of another type is returned as it is, for the
+ * command to fail on. Commands that only replace or delete the value use
+ * lookupKeyWrite. */
+robj *lookupKeyWriteInPlaceWithVersion(redisDb *db, robj *key, int type,
+                                       uint16_t *version) {
+    robj *val = lookupKeyWriteWithVersion(db,key,version);
+
+    if (val != NULL && val->type == type && val->refcount > 1)
+        val = unshareCompactObject(db,key,val);
+    return val;
+}
+
 /* Add the key to the DB. If the key already exists REDIS_ERR is returned,
  * otherwise REDIS_OK is returned, and the caller should increment the
  * refcount of 'val'. */
@@ -45,7 +167,12 @@ int dbAdd(redisDb *db, robj *key, robj *val) {
         return REDIS_ERR;
     } else {
         sds copy = sdsdup(key->ptr);
-        dictAdd(db->dict, copy, val);
+        initObjectAccess(db,val,NULL);
+        activateDb(db);
+        if (dictAdd(db->dict, copy, val) != DICT_OK) {
+            sdsfree(copy);
+            return REDIS_ERR;
+        }
         return REDIS_OK;
     }
 }
@@ -60,11 +187,19 @@ int dbUpdateKey(redisDb *db, robj* key) {
 }
 
 /* like dbReplace but it will change key in db
- * version will will change */
+ * version will will change. -1 is returned if the key could not be added,
+ * in which case 'val' was not stored. */
 int dbSuperReplace(redisDb *db, robj *key, robj *val) {
-    if (dictFind(db->dict,key->ptr) == NULL) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    initObjectAccess(db,val,de);
+    if (de == NULL) {
         sds copy = sdsdup(key->ptr);
-        dictAdd(db->dict, copy, val);
+        activateDb(db);
+        if (dictAdd(db->dict, copy, val) != DICT_OK) {
+            sdsfree(copy);
+            return -1;
+        }
         return 1;
     } else {
         dictSuperReplace(db->dict, key->ptr, val);
@@ -75,11 +210,19 @@ int dbSuperReplace(redisDb *db, robj *key, robj *val) {
 /* If the key does not exist, this is just like dbAdd(). Otherwise
  * the value associated to the key is replaced with the new one.
  *
- * On update (key already existed) 0 is returned. Otherwise 1. */
+ * On update (key already existed) 0 is returned. Otherwise 1, or -1 if the
+ * key could not be added and 'val' was not stored. */
 int dbReplace(redisDb *db, robj *key, robj *val) {
-    if (dictFind(db->dict,key->ptr) == NULL) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    initObjectAccess(db,val,de);
+    if (de == NULL) {
         sds copy = sdsdup(key->ptr);
-        dictAdd(db->dict, copy, val);
+        activateDb(db);
+        if (dictAdd(db->dict, copy, val) != DICT_OK) {
+            sdsfree(copy);
+            return -1;
+        }
         return 1;
     } else {
         dictReplace(db->dict, key->ptr, val);
@@ -125,16 +268,135 @@ int dbDelete(redisDb *db, robj *key) {
     return dictDelete(db->dict,key->ptr) == DICT_OK;
 }
 
+/* A db only gets a keyspace of its own with its first key. Until then
+ * db->dict and db->expires are server->emptydict and server->emptyexpires,
+ * shared by all the inactive dbs and never written, so an idle db costs
+ * no memory. The active dbs are listed in server->active_db, that is what
+ * the cron walks through, and an active db that is found empty again is
+ * made inactive by releaseIdleDb(). */
+void activateDb(redisDb *db) {
+    redisServer *server = db->server;
+    int dbnum;
+
+    if (db->active_idx >= 0) return;
+    dbnum = get_malloc_dbnum();
+    set_malloc_dbnum(db->id);
+    db->dict = dictCreateOpen(&dbDictType,server);
+    db->expires = dictCreateOpen(&keyptrDictType,NULL);
+    set_malloc_dbnum(dbnum);
+    db->active_idx = server->active_dbnum;
+    server->active_db[server->active_dbnum++] = db->id;
+}
+
+/* Give the db back the shared empty keyspace, without freeing the old
+ * one, and take it off the active list. */
+static void resetDbKeyspace(redisDb *db) {
+    redisServer *server = db->server;
+    int last;
+
+    if (db->active_idx >= 0) {
+        last = server->active_db[--server->active_dbnum];
+        server->active_db[db->active_idx] = last;
+        server->db[last].active_idx = db->active_idx;
+        db->active_idx = -1;
+    }
+    db->dict = server->emptydict;
+    db->expires = server->emptyexpires;
+    db->expire_wheel = NULL;
+    db->eviction_pool[0] = NULL;
+    db->eviction_pool[1] = NULL;
+    db->need_remove_key = 0;
+    db->sweep_running = 0;
+    db->expire_effort = REDIS_EXPIRE_EFFORT_MIN;
+}
+
+/* Free the keyspace of the active db and make it inactive */
+static void releaseDbKeyspace(redisDb *db) {
+    int dbnum = get_malloc_dbnum();
+
+    set_malloc_dbnum(db->id);
+    /* The expires first: their destructor unlinks the nodes of the wheel */
+    dictRelease(db->expires);
+    dictRelease(db->dict);
+    if (db->expire_wheel) twRelease(db->expire_wheel);
+    evictionPoolRelease(db);
+    set_malloc_dbnum(dbnum);
+    resetDbKeyspace(db);
+}
+
+/* Make the db inactive if it is active and holds no key. Return 1 if it
+ * was. */
+int releaseIdleDb(redisDb *db) {
+    if (db->active_idx < 0 || dictSize(db->dict) != 0) return 0;
+    releaseDbKeyspace(db);
+    return 1;
+}
+
 /* Empty the whole database */
 long long emptyDb(redisServer *server) {
-    int j;
     long long removed = 0;
 
-    for (j = 0; j < server->dbnum; j++) {
-        removed += dictSize(server->db[j].dict);
-        dictEmpty(server->db[j].dict);
-        dictEmpty(server->db[j].expires);
+    while (server->active_dbnum) {
+        redisDb *db = server->db+server->active_db[0];
+
+        removed += dictSize(db->dict);
+        releaseDbKeyspace(db);
+    }
+    return removed;
+}
+
+/* Make the empty db 'id' allocate its keyspace from its own zmalloc arena,
+ * so that dropDb() can free it in bulk. */
+int enableDbArena(redisServer *server, int id) {
+    redisDb *db;
+
+    if (id < 0 || id >= server->dbnum) return REDIS_ERR_NAMESPACE_ERROR;
+    db = server->db+id;
+    if (dictSize(db->dict) != 0 || zmalloc_arena_enabled(id))
+        return REDIS_ERR;
+    if (db->active_idx >= 0) releaseDbKeyspace(db);
+    if (zmalloc_arena_create(id) != 0) return REDIS_ERR;
+    return REDIS_OK;
+}
+
+/* Return 1 if something outside the keyspace may still point into the
+ * arena of the db: a reply of its commands holding elements or a pinned
+ * value, or the arguments of a client selecting it. */
+static int dbArenaInUse(redisServer *server, redisDb *db) {
+    listIter li;
+    listNode *ln;
+
+    if (db->replies) return 1;
+    listRewind(server->clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        redisClient *c = listNodeValue(ln);
+
+        if (c->db == db && c->argc) return 1;
+    }
+    return 0;
+}
+
+/* Remove all the keys of the db 'id', returning how many there were.
+ * With an arena the keyspace is dropped with it whatever its size, else
+ * it is freed key by key. The keyspace is also freed key by key while
+ * something else still points into the arena, see dbArenaInUse(). */
+long long dropDb(redisServer *server, int id) {
+    redisDb *db;
+    long long removed;
+
+    if (id < 0 || id >= server->dbnum) return 0;
+    db = server->db+id;
+    if (db->active_idx < 0) return 0;
+    removed = dictSize(db->dict);
+
+    if (zmalloc_arena_enabled(id) && !dbArenaInUse(server,db)) {
+        /* Values of the db may still be queued for freeing */
+        lazyfreeDrain();
+        zmalloc_arena_reset(id);
+        resetDbKeyspace(db);
+        return removed;
     }
+    releaseDbKeyspace(db);
     return removed;
 }
 
@@ -226,27 +488,64 @@ int removeXExpire(redisDb *db, robj *key) {
     return dictDelete(db->expires,key->ptr) == DICT_OK;
 }
 
-void setExpire(redisDb *db, robj *key, time_t when) {
+/* Set the expire of the key found at 'de' in the main dict, in UNIX
+ * milliseconds. The expires dict maps the key to a node of
+ * db->expire_wheel, that activeExpireCycle() pops keys from as they
+ * become due. REDIS_ERR is returned if the key couldn't be added to the
+ * expires dict, and the key is left without an expire. */
+static int setEntryExpire(redisDb *db, dictEntry *de, long long when) {
+    sds key = dictGetEntryKey(de);
+    dictEntry *ede;
+    twNode *n;
+
+    if (db->expire_wheel == NULL)
+        db->expire_wheel = twCreate(shared.mstime-1);
+    if ((ede = dictFind(db->expires,key)) != NULL) {
+        n = dictGetEntryVal(ede);
+        twRemove(n);
+    } else {
+        n = zpool_alloc(sizeof(*n));
+        n->next = NULL;
+        n->pprev = NULL;
+        /* Reuse the sds from the main dict in the expire dict */
+        n->data = key;
+        if (dictAdd(db->expires,key,n) != DICT_OK) {
+            zpool_free(n,sizeof(*n));
+            return REDIS_ERR;
+        }
+    }
+    n->when = when;
+    twAdd(db->expire_wheel,n);
+    return REDIS_OK;
+}
+
+/* Expires given in seconds are stored as the last millisecond of that
+ * second, so the key still expires when time(NULL) > when. */
+#define EXPIRE_SEC_TO_MS(when) ((long long)(when)*1000+999)
+
+int setExpireMs(redisDb *db, robj *key, long long when) {
     dictEntry *de;
 
-    /* Reuse the sds from the main dict in the expire dict */
     de = dictFind(db->dict,key->ptr);
     redisAssert(de != NULL);
-    dictReplace(db->expires,dictGetEntryKey(de),(void*)when);
+    return setEntryExpire(db,de,when);
 }
 
-void setXExpire(redisDb *db, robj *key, time_t when) {
+int setExpire(redisDb *db, robj *key, time_t when) {
+    return setExpireMs(db,key,EXPIRE_SEC_TO_MS(when));
+}
+
+int setXExpire(redisDb *db, robj *key, time_t when) {
     dictEntry *de;
 
-    /* Reuse the sds from the main dict in the expire dict */
     de = dictFind(db->dict,key->ptr);
-    if(de == NULL) return;
-    dictReplace(db->expires,dictGetEntryKey(de),(void*)when);
+    if(de == NULL) return REDIS_ERR;
+    return setEntryExpire(db,de,EXPIRE_SEC_TO_MS(when));
 }
 
-/* Return the expire time of the specified key, or -1 if no expire
- * is associated with this key (i.e. the key is non volatile) */
-time_t getExpire(redisDb *db, robj *key) {
+/* Return the expire time of the specified key in UNIX milliseconds, or -1
+ * if no expire is associated with this key (i.e. the key is non volatile) */
+long long getExpireMs(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
@@ -256,7 +555,14 @@ time_t getExpire(redisDb *db, robj *key) {
     /* The entry was found in the expire dict, this means it should also
      * be present in the main dict (safety check). */
     redisAssert(dictFind(db->dict,key->ptr) != NULL);
-    return (time_t) dictGetEntryVal(de);
+    return ((twNode*)dictGetEntryVal(de))->when;
+}
+
+/* Same as getExpireMs() in seconds */
+time_t getExpire(redisDb *db, robj *key) {
+    long long when = getExpireMs(db,key);
+
+    return (when == -1) ? -1 : (time_t) (when/1000);
 }
 
 /* Return the logic clock of the specified key, or 0 if no key exist */
@@ -274,11 +580,13 @@ uint16_t getLogiClock(redisDb *db, robj *key) {
     return logiclock;
 }
 
-int expireIfNeeded(redisDb *db, robj *key) {
-    uint16_t logiclock = getLogiClock(db, key);
-    if (logiclock == 0) {
-        return 0;
-    }
+/* The part of expireIfNeeded() following the lookup of the key, for callers
+ * already holding its entry in db->dict. 'de' must not be used after the
+ * call, as the lookup of the expire may rehash the dict. */
+static int expireEntryIfNeeded(redisDb *db, robj *key, dictEntry *de) {
+    uint16_t logiclock = sdslogiclock((sds)dictGetEntryKey(de));
+
+    redisAssert(logiclock != 0);
     if (db->logiclock > logiclock) {
         /* Delete the key */
         db->need_remove_key--;
@@ -286,18 +594,26 @@ int expireIfNeeded(redisDb *db, robj *key) {
         return dbDelete(db,key);
     }
 
-    time_t when = getExpire(db,key);
+    long long when = getExpireMs(db,key);
 
     if (when < 0) return 0; /* No expire for this key */
 
-    /* Return when this key has not expired */
-    if (time(NULL) <= when) return 0;
+    /* Return when this key has not expired. The cached clock is refreshed
+     * before every command, see call(). */
+    if (shared.mstime <= when) return 0;
 
     /* Delete the key */
     db->stat_expiredkeys++;
     return dbDelete(db,key);
 }
 
+int expireIfNeeded(redisDb *db, robj *key) {
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    if (de == NULL) return 0;
+    return expireEntryIfNeeded(db,key,de);
+}
+
 /*-----------------------------------------------------------------------------
  * Expires Commands
  *----------------------------------------------------------------------------*/
@@ -313,12 +629,14 @@ int expireIfNeeded(redisDb *db, robj *key) {
 //else if seconds > now time then
 //we conssider that you give us UNIX timestamp (seconds since January 1, 1970)(just as redis's expireat)
 //so it's equal persist + expire + expireat
-void expireXGenericCommand(redisClient *c, robj *key, robj *param) {
+//pexpire follows the same protocol in milliseconds: 'unit' is 1000 when
+//the param is in seconds, 1 when it is in milliseconds
+static void expireXGenericCommandWithUnit(redisClient *c, robj *key,
+                                          robj *param, int unit) {
     dictEntry *de;
-    long seconds;
-    time_t when;
+    long long val;
 
-    if (getLongFromObject(param, &seconds) != REDIS_OK) {
+    if (getLongLongFromObject(param, &val) != REDIS_OK) {
         c->returncode = REDIS_ERR_IS_NOT_INTEGER;
         return;
     }
@@ -329,16 +647,22 @@ void expireXGenericCommand(redisClient *c, robj *key, robj *param) {
         return;
     }
 
-    if (seconds > 0) {
-        time_t now = time(NULL);
-        if (seconds <= now) {
-            when = now+seconds;
+    if (val > 0) {
+        long long now = shared.mstime/unit;
+        long long when = (val <= now) ? now+val : val;
+        int retval;
+
+        if (unit == 1000) {
+            retval = setExpire(c->db,key,(time_t)when);
         } else {
-            when = seconds;
+            retval = setExpireMs(c->db,key,when);
+        }
+        if (retval != REDIS_OK) {
+            c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+            return;
         }
-        setExpire(c->db,key,when);
         c->server->dirty++;
-    } else if(seconds == 0 && removeExpire(c->db, c->argv[1])) {
+    } else if(val == 0 && removeExpire(c->db, c->argv[1])) {
         c->server->dirty++;
     }
 
@@ -346,20 +670,30 @@ void expireXGenericCommand(redisClient *c, robj *key, robj *param) {
     return;
 }
 
+void expireXGenericCommand(redisClient *c, robj *key, robj *param) {
+    expireXGenericCommandWithUnit(c,key,param,1000);
+}
+
 void expireCommand(redisClient *c) {
     expireXGenericCommand(c,c->argv[1],c->argv[2]);
 }
 
-void ttlCommand(redisClient *c) {
-    time_t expire, ttl = -1;
+void pexpireCommand(redisClient *c) {
+    expireXGenericCommandWithUnit(c,c->argv[1],c->argv[2],1);
+}
 
-    expire = getExpire(c->db,c->argv[1]);
+/* Reply with the time to live of the key in 'unit' milliseconds, rounded
+ * down. An expired key not deleted yet, or a key without expire, gives 0. */
+static void ttlGenericCommand(redisClient *c, int unit) {
+    long long expire, ttl = -1;
+
+    expire = getExpireMs(c->db,c->argv[1]);
     if (expire != -1) {
-        ttl = (expire-time(NULL));
-        if (ttl < 0) ttl = -1;
+        ttl = expire-shared.mstime;
+        ttl = (ttl < 0) ? -1 : ttl/unit;
     } else if (dbExists(c->db, c->argv[1]) == 0) {
         //mean not exist
-        c->retvalue.llnum = (long long)ttl;
+        c->retvalue.llnum = ttl;
         if (c->retvalue.llnum == -1) {
             c->retvalue.llnum = 0;
         }
@@ -367,13 +701,21 @@ void ttlCommand(redisClient *c) {
         return;
     }
 
-    c->retvalue.llnum = (long long)ttl;
+    c->retvalue.llnum = ttl;
     if (c->retvalue.llnum == -1) {
         c->retvalue.llnum = 0;
     }
     c->returncode = REDIS_OK;
 }
 
+void ttlCommand(redisClient *c) {
+    ttlGenericCommand(c,1000);
+}
+
+void pttlCommand(redisClient *c) {
+    ttlGenericCommand(c,1);
+}
+
 void persistCommand(redisClient *c) {
     dictEntry *de;
 
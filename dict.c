@@ -3,7 +3,8 @@
  * This file implements in memory hash tables with insert/del/replace/find/
  * get-random-element operations. Hash tables will auto resize if needed
  * tables of power of two in size are used, collisions are handled by
- * chaining. See the source code for more information... :)
+ * chaining, or by open addressing for dicts created with dictCreateOpen().
+ * See the source code for more information... :)
  *
  * Copyright (c) 2006-2010, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved.
@@ -47,6 +48,18 @@
 #include "dict.h"
 #include "zmalloc.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Chained tables allocate one of these per element, the dictEntry handed
+ * to the user is the first member. */
+typedef struct dictChainEntry {
+    dictEntry e;
+    struct dictChainEntry *next;
+    unsigned int hash;  /* dictHashKey() of key, kept for rehash and lookup */
+} dictChainEntry;
+
 /* Using dictEnableResize() / dictDisableResize() we make possible to
  * enable/disable resizing of the hash table as needed. This is very important
  * for Redis, as we use copy-on-write and don't want to move too much memory
@@ -58,12 +71,31 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Table arrays are allocated with zcalloc_huge(), so a huge one costs no
+ * memory until used. While it is rehashed away the part already moved is
+ * given back every DICT_RELEASE_CHUNK bytes, so a big table does not hold
+ * twice its memory until the end of the rehashing, and freeing it at the
+ * end has little left to do. */
+#define DICT_RELEASE_CHUNK (1024*64)
+
 /* -------------------------- private prototypes ---------------------------- */
 
+static void _dictReleaseRehashed(void *array, size_t esize,
+                                 unsigned long from, unsigned long to);
+
 static int _dictExpandIfNeeded(dict *ht);
 static unsigned long _dictNextPower(unsigned long size);
-static int _dictKeyIndex(dict *ht, const void *key);
+static int _dictKeyIndex(dict *ht, const void *key, unsigned int *hash);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
+static int _dictOpenExpand(dict *d, unsigned long size);
+static void _dictOpenGrowTarget(dict *d);
+static int _dictOpenRehash(dict *d, int n);
+static int _dictOpenAdd(dict *d, void *key, void *val);
+static dictEntry *_dictOpenFind(dict *d, const void *key, unsigned int h);
+static void _dictOpenPrefetch(dictht *ht, unsigned int h, int entry);
+static int _dictOpenDelete(dict *d, const void *key, int nofree);
+static void _dictOpenClear(dict *d, dictht *ht);
+static dictEntry *_dictOpenRandomKey(dict *d);
 
 /* -------------------------- hash functions -------------------------------- */
 
@@ -85,23 +117,75 @@ unsigned int dictIdentityHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic hash function (a popular one from Bernstein).
- * I tested a few and this was the best. */
-unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
+/* Generic hash function: SipHash-1-2 keyed with a per process seed, so that
+ * whoever controls key names can't force collisions. It consumes the input
+ * 8 bytes at a time; the 64 bit result is truncated to the table hash. */
+static uint64_t dict_hash_seed[2] = {
+    0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL
+};
+
+void dictSetHashFunctionSeed(const unsigned char *seed) {
+    memcpy(dict_hash_seed,seed,sizeof(dict_hash_seed));
+}
+
+#define SIP_ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND do { \
+    v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+    v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); \
+} while(0)
+
+/* Little endian load of 8 bytes, optionally folding ASCII case. */
+static inline uint64_t sipLoad64(const unsigned char *p, int nocase) {
+    uint64_t m = 0;
+    int j;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if (!nocase) {
+        memcpy(&m,p,8);
+        return m;
+    }
+#endif
+    for (j = 7; j >= 0; j--)
+        m = (m << 8) | (nocase ? (unsigned char)tolower(p[j]) : p[j]);
+    return m;
+}
+
+static inline uint64_t sipHash(const unsigned char *in, int len, int nocase) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ dict_hash_seed[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ dict_hash_seed[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ dict_hash_seed[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ dict_hash_seed[1];
+    uint64_t b = ((uint64_t)len) << 56, m;
+    const unsigned char *end = in + (len & ~7);
+    int j;
+
+    for (; in != end; in += 8) {
+        m = sipLoad64(in,nocase);
+        v3 ^= m;
+        SIP_ROUND;
+        v0 ^= m;
+    }
+    for (j = (len & 7)-1; j >= 0; j--)
+        b |= ((uint64_t)(nocase ? (unsigned char)tolower(in[j]) : in[j])) << (j*8);
+    v3 ^= b;
+    SIP_ROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND;
+    SIP_ROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
 
-    while (len--)
-        hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
-    return hash;
+unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
+    return (unsigned int)sipHash(buf,len,0);
 }
 
 /* And a case insensitive version */
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
-
-    while (len--)
-        hash = ((hash << 5) + hash) + (tolower(*buf++)); /* hash * 33 + c */
-    return hash;
+    return (unsigned int)sipHash(buf,len,1);
 }
 
 /* ----------------------------- API implementation ------------------------- */
@@ -111,9 +195,13 @@ unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
 static void _dictReset(dictht *ht)
 {
     ht->table = NULL;
+    ht->slots = NULL;
+    ht->ctrl = NULL;
+    ht->hashes = NULL;
     ht->size = 0;
     ht->sizemask = 0;
     ht->used = 0;
+    ht->deleted = 0;
 }
 
 /* Create a new hash table */
@@ -126,6 +214,19 @@ dict *dictCreate(dictType *type,
     return d;
 }
 
+/* Create a new open addressing hash table. Same API as dictCreate(), but
+ * elements are stored inline in the table, so a dictEntry returned by
+ * dictFind() or an iterator is only valid until the next call that may
+ * add, delete or rehash. */
+dict *dictCreateOpen(dictType *type,
+        void *privDataPtr)
+{
+    dict *d = dictCreate(type,privDataPtr);
+
+    d->open = 1;
+    return d;
+}
+
 /* Initialize the hash table */
 int _dictInit(dict *d, dictType *type,
         void *privDataPtr)
@@ -136,6 +237,7 @@ int _dictInit(dict *d, dictType *type,
     d->privdata = privDataPtr;
     d->rehashidx = -1;
     d->iterators = 0;
+    d->open = 0;
     return DICT_OK;
 }
 
@@ -156,7 +258,10 @@ int dictResize(dict *d)
 int dictExpand(dict *d, unsigned long size)
 {
     dictht n; /* the new hashtable */
-    unsigned long realsize = _dictNextPower(size);
+    unsigned long realsize;
+
+    if (d->open) return _dictOpenExpand(d,size);
+    realsize = _dictNextPower(size);
 
     /* the size is invalid if it is smaller than the number of
      * elements already inside the hashtable */
@@ -166,8 +271,12 @@ int dictExpand(dict *d, unsigned long size)
     /* Allocate the new hashtable and initialize all pointers to NULL */
     n.size = realsize;
     n.sizemask = realsize-1;
-    n.table = redis_zcalloc(realsize*sizeof(dictEntry*));
+    n.table = zcalloc_huge(realsize*sizeof(dictChainEntry*));
+    n.slots = NULL;
+    n.ctrl = NULL;
+    n.hashes = NULL;
     n.used = 0;
+    n.deleted = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
      * we just set the first hash table so that it can accept keys. */
@@ -185,12 +294,18 @@ int dictExpand(dict *d, unsigned long size)
 /* Performs N steps of incremental rehashing. Returns 1 if there are still
  * keys to move from the old to the new hash table, otherwise 0 is returned.
  * Note that a rehashing step consists in moving a bucket (that may have more
- * thank one key as we use chaining) from the old to the new hash table. */
+ * thank one key as we use chaining) from the old to the new hash table.
+ * At most N*10 empty buckets are visited as well, so that a step over a big
+ * table left mostly empty (as shrinking it) does not take long either. */
 int dictRehash(dict *d, int n) {
+    unsigned long from, empty_visits = (unsigned long)n*10;
+
     if (!dictIsRehashing(d)) return 0;
+    if (d->open) return _dictOpenRehash(d,n);
 
+    from = d->rehashidx;
     while(n--) {
-        dictEntry *de, *nextde;
+        dictChainEntry *de, *nextde;
 
         /* Check if we already rehashed the whole table... */
         if (d->ht[0].used == 0) {
@@ -203,7 +318,14 @@ int dictRehash(dict *d, int n) {
 
         /* Note that rehashidx can't overflow as we are sure there are more
          * elements because ht[0].used != 0 */
-        while(d->ht[0].table[d->rehashidx] == NULL) d->rehashidx++;
+        while(d->ht[0].table[d->rehashidx] == NULL) {
+            d->rehashidx++;
+            if (--empty_visits == 0) {
+                _dictReleaseRehashed(d->ht[0].table,sizeof(dictChainEntry*),
+                                     from,d->rehashidx);
+                return 1;
+            }
+        }
         de = d->ht[0].table[d->rehashidx];
         /* Move all the keys in this bucket from the old to the new hash HT */
         while(de) {
@@ -211,7 +333,7 @@ int dictRehash(dict *d, int n) {
 
             nextde = de->next;
             /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
+            h = de->hash & d->ht[1].sizemask;
             de->next = d->ht[1].table[h];
             d->ht[1].table[h] = de;
             d->ht[0].used--;
@@ -221,9 +343,23 @@ int dictRehash(dict *d, int n) {
         d->ht[0].table[d->rehashidx] = NULL;
         d->rehashidx++;
     }
+    _dictReleaseRehashed(d->ht[0].table,sizeof(dictChainEntry*),
+                         from,d->rehashidx);
     return 1;
 }
 
+/* Give back the memory of the entries [from,to) of the ht[0] array that
+ * the rehashing is done with. Chunks are counted from the start of the
+ * array, so that successive calls tile it. */
+static void _dictReleaseRehashed(void *array, size_t esize,
+                                 unsigned long from, unsigned long to)
+{
+    size_t start = from*esize/DICT_RELEASE_CHUNK*DICT_RELEASE_CHUNK;
+    size_t end = to*esize/DICT_RELEASE_CHUNK*DICT_RELEASE_CHUNK;
+
+    if (end > start) zmalloc_release_range(array,start,end-start);
+}
+
 long long timeInMilliseconds(void) {
     struct timeval tv;
 
@@ -259,26 +395,31 @@ static void _dictRehashStep(dict *d) {
 int dictAdd(dict *d, void *key, void *val)
 {
     int index;
-    dictEntry *entry;
+    unsigned int hash;
+    dictChainEntry *entry;
+    dictEntry *de;
     dictht *ht;
 
+    if (d->open) return _dictOpenAdd(d,key,val);
     if (dictIsRehashing(d)) _dictRehashStep(d);
 
     /* Get the index of the new element, or -1 if
      * the element already exists. */
-    if ((index = _dictKeyIndex(d, key)) == -1)
+    if ((index = _dictKeyIndex(d, key, &hash)) == -1)
         return DICT_ERR;
 
     /* Allocates the memory and stores key */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    entry = zpool_alloc(sizeof(*entry));
+    entry->hash = hash;
     entry->next = ht->table[index];
     ht->table[index] = entry;
     ht->used++;
 
     /* Set the hash entry fields. */
-    dictSetHashKey(d, entry, key);
-    dictSetHashVal(d, entry, val);
+    de = &entry->e;
+    dictSetHashKey(d, de, key);
+    dictSetHashVal(d, de, val);
     return DICT_OK;
 }
 
@@ -353,10 +494,11 @@ int dictReplace(dict *d, void *key, void *val)
 static int dictGenericDelete(dict *d, const void *key, int nofree)
 {
     unsigned int h, idx;
-    dictEntry *he, *prevHe;
+    dictChainEntry *he, *prevHe;
     int table;
 
     if (d->ht[0].size == 0) return DICT_ERR; /* d->ht[0].table is NULL */
+    if (d->open) return _dictOpenDelete(d,key,nofree);
     if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
 
@@ -365,17 +507,17 @@ static int dictGenericDelete(dict *d, const void *key, int nofree)
         he = d->ht[table].table[idx];
         prevHe = NULL;
         while(he) {
-            if (dictCompareHashKeys(d, key, he->key)) {
+            if (he->hash == h && dictCompareHashKeys(d, key, he->e.key)) {
                 /* Unlink the element from the list */
                 if (prevHe)
                     prevHe->next = he->next;
                 else
                     d->ht[table].table[idx] = he->next;
                 if (!nofree) {
-                    dictFreeEntryKey(d, he);
-                    dictFreeEntryVal(d, he);
+                    dictFreeEntryKey(d, &he->e);
+                    dictFreeEntryVal(d, &he->e);
                 }
-                zfree(he);
+                zpool_free(he,sizeof(*he));
                 d->ht[table].used--;
                 return DICT_OK;
             }
@@ -400,16 +542,20 @@ int _dictClear(dict *d, dictht *ht)
 {
     unsigned long i;
 
+    if (d->open) {
+        _dictOpenClear(d,ht);
+        return DICT_OK;
+    }
     /* Free all the elements */
     for (i = 0; i < ht->size && ht->used > 0; i++) {
-        dictEntry *he, *nextHe;
+        dictChainEntry *he, *nextHe;
 
         if ((he = ht->table[i]) == NULL) continue;
         while(he) {
             nextHe = he->next;
-            dictFreeEntryKey(d, he);
-            dictFreeEntryVal(d, he);
-            zfree(he);
+            dictFreeEntryKey(d, &he->e);
+            dictFreeEntryVal(d, &he->e);
+            zpool_free(he,sizeof(*he));
             ht->used--;
             he = nextHe;
         }
@@ -431,18 +577,26 @@ void dictRelease(dict *d)
 
 dictEntry *dictFind(dict *d, const void *key)
 {
-    dictEntry *he;
-    unsigned int h, idx, table;
-
     if (d->ht[0].size == 0) return NULL; /* We don't have a table at all */
+    return dictFindWithHash(d,key,dictHashKey(d, key));
+}
+
+/* Like dictFind() for a key whose hash was already computed with
+ * dictGetHash(), see dictPrefetch(). */
+dictEntry *dictFindWithHash(dict *d, const void *key, unsigned int h)
+{
+    dictChainEntry *he;
+    unsigned int idx, table;
+
+    if (d->ht[0].size == 0) return NULL;
+    if (d->open) return _dictOpenFind(d,key,h);
     if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
-            if (dictCompareHashKeys(d, key, he->key))
-                return he;
+            if (he->hash == h && dictCompareHashKeys(d, key, he->e.key))
+                return &he->e;
             he = he->next;
         }
         if (!dictIsRehashing(d)) return NULL;
@@ -450,6 +604,33 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+unsigned int dictGetHash(dict *d, const void *key) {
+    return dictHashKey(d, key);
+}
+
+/* Issue prefetches for the lookup of a key with hash 'h', so that the cache
+ * misses of several lookups overlap. Batched lookups call it twice per key
+ * before dictFindWithHash(): first with entry == 0 to load the bucket, then
+ * with entry == 1 to load the entry the bucket points to. It never blocks
+ * or modifies the dict. */
+void dictPrefetch(dict *d, unsigned int h, int entry) {
+    int table;
+
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        if (ht->size == 0) break;
+        if (d->open) {
+            _dictOpenPrefetch(ht,h,entry);
+        } else if (!entry) {
+            __builtin_prefetch(&ht->table[h & ht->sizemask]);
+        } else if (ht->table[h & ht->sizemask]) {
+            __builtin_prefetch(ht->table[h & ht->sizemask]);
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+}
+
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
 
@@ -465,6 +646,7 @@ dictIterator *dictGetIterator(dict *d)
     iter->table = 0;
     iter->index = -1;
     iter->safe = 0;
+    iter->size = 0;
     iter->entry = NULL;
     iter->nextEntry = NULL;
     return iter;
@@ -479,6 +661,34 @@ dictIterator *dictGetSafeIterator(dict *d) {
 
 dictEntry *dictNext(dictIterator *iter)
 {
+    if (iter->d->open) {
+        while (1) {
+            dictht *ht = &iter->d->ht[iter->table];
+            if (iter->safe && iter->index == -1 && iter->table == 0)
+                iter->d->iterators++;
+            /* The new table was moved to a larger one while we walked it:
+             * start it over, so entries may be returned twice but none is
+             * missed. */
+            if (iter->table == 1 && iter->size != ht->size) {
+                iter->size = ht->size;
+                iter->index = -1;
+            }
+            iter->index++;
+            if (iter->index >= (signed) ht->size) {
+                if (dictIsRehashing(iter->d) && iter->table == 0) {
+                    iter->table++;
+                    iter->index = -1;
+                    iter->size = iter->d->ht[1].size;
+                    continue;
+                }
+                break;
+            }
+            /* full slots have the high bit of the control byte clear */
+            if (!(ht->ctrl[iter->index] & 0x80))
+                return &ht->slots[iter->index];
+        }
+        return NULL;
+    }
     while (1) {
         if (iter->entry == NULL) {
             dictht *ht = &iter->d->ht[iter->table];
@@ -502,7 +712,7 @@ dictEntry *dictNext(dictIterator *iter)
             /* We need to save the 'next' here, the iterator user
              * may delete the entry we are returning. */
             iter->nextEntry = iter->entry->next;
-            return iter->entry;
+            return &iter->entry->e;
         }
     }
     return NULL;
@@ -519,11 +729,12 @@ void dictReleaseIterator(dictIterator *iter)
  * implement randomized algorithms */
 dictEntry *dictGetRandomKey(dict *d)
 {
-    dictEntry *he, *orighe;
+    dictChainEntry *he, *orighe;
     unsigned int h;
     int listlen, listele;
 
     if (dictSize(d) == 0) return NULL;
+    if (d->open) return _dictOpenRandomKey(d);
     if (dictIsRehashing(d)) _dictRehashStep(d);
     if (dictIsRehashing(d)) {
         do {
@@ -551,7 +762,90 @@ dictEntry *dictGetRandomKey(dict *d)
     listele = random() % listlen;
     he = orighe;
     while(listele--) he = he->next;
-    return he;
+    return &he->e;
+}
+
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v);
+    unsigned long mask = ~0UL;
+
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+static void _dictScanBucket(dict *d, dictht *ht, unsigned long idx,
+                            dictScanFunction *fn, void *privdata)
+{
+    dictChainEntry *he, *next;
+
+    if (d->open) {
+        /* full slots have the high bit of the control byte clear */
+        if (!(ht->ctrl[idx] & 0x80)) fn(privdata,&ht->slots[idx]);
+        return;
+    }
+    for (he = ht->table[idx]; he; he = next) {
+        next = he->next;
+        fn(privdata,&he->e);
+    }
+}
+
+/* Visit the entries of the bucket (or slot) at cursor 'v', and return the
+ * cursor to pass to the next call, 0 when the scan is over. The cursor is
+ * incremented from its high bits, so buckets already visited map to
+ * buckets already visited when the table grows or shrinks between calls.
+ *
+ * Entries found at the start of a scan are returned at least once as
+ * long as the table is not resized, and with chaining even then. Entries
+ * moved by a resize of an open addressing table may be missed or
+ * returned twice, as their slot does not only depend on their hash.
+ *
+ * 'fn' must not modify the dict. */
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn,
+                       void *privdata)
+{
+    dictht *t0, *t1;
+    unsigned long m0, m1;
+
+    if (dictSize(d) == 0) return 0;
+
+    if (!dictIsRehashing(d)) {
+        t0 = &d->ht[0];
+        m0 = t0->sizemask;
+        _dictScanBucket(d,t0,v & m0,fn,privdata);
+
+        /* Set unmasked bits so incrementing the reversed cursor operates
+         * on the masked bits of the smaller table */
+        v |= ~m0;
+        v = rev(v);
+        v++;
+        v = rev(v);
+    } else {
+        t0 = &d->ht[0];
+        t1 = &d->ht[1];
+
+        /* Make sure t0 is the smaller and t1 is the bigger table */
+        if (t0->size > t1->size) {
+            t0 = &d->ht[1];
+            t1 = &d->ht[0];
+        }
+        m0 = t0->sizemask;
+        m1 = t1->sizemask;
+        _dictScanBucket(d,t0,v & m0,fn,privdata);
+
+        /* Visit the buckets of the bigger table that expand the bucket of
+         * the smaller one */
+        do {
+            _dictScanBucket(d,t1,v & m1,fn,privdata);
+            v |= ~m1;
+            v = rev(v);
+            v++;
+            v = rev(v);
+        } while (v & (m0 ^ m1));
+    }
+    return v;
 }
 
 /* ------------------------- private functions ------------------------------ */
@@ -597,23 +891,25 @@ static unsigned long _dictNextPower(unsigned long size)
  * If the key already exists, -1 is returned.
  *
  * Note that if we are in the process of rehashing the hash table, the
- * index is always returned in the context of the second (new) hash table. */
-static int _dictKeyIndex(dict *d, const void *key)
+ * index is always returned in the context of the second (new) hash table.
+ * The hash of the key is stored in '*hash' for the new entry. */
+static int _dictKeyIndex(dict *d, const void *key, unsigned int *hash)
 {
     unsigned int h, idx, table;
-    dictEntry *he;
+    dictChainEntry *he;
 
     /* Expand the hashtable if needed */
     if (_dictExpandIfNeeded(d) == DICT_ERR)
         return -1;
     /* Compute the key hash value */
     h = dictHashKey(d, key);
+    *hash = h;
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         /* Search if this slot does not already contain the given key */
         he = d->ht[table].table[idx];
         while(he) {
-            if (dictCompareHashKeys(d, key, he->key))
+            if (he->hash == h && dictCompareHashKeys(d, key, he->e.key))
                 return -1;
             he = he->next;
         }
@@ -642,7 +938,7 @@ static void _dictPrintStatsHt(dictht *ht) {
 
     for (i = 0; i < DICT_STATS_VECTLEN; i++) clvector[i] = 0;
     for (i = 0; i < ht->size; i++) {
-        dictEntry *he;
+        dictChainEntry *he;
 
         if (ht->table[i] == NULL) {
             clvector[0]++;
@@ -674,11 +970,425 @@ static void _dictPrintStatsHt(dictht *ht) {
     }
 }
 
+static void _dictOpenPrintStatsHt(dictht *ht) {
+    if (ht->used == 0) {
+        printf("No stats available for empty dictionaries\n");
+        return;
+    }
+    printf("Hash table stats (open addressing):\n");
+    printf(" table size: %ld\n", ht->size);
+    printf(" number of elements: %ld\n", ht->used);
+    printf(" deleted slots: %ld\n", ht->deleted);
+    printf(" load factor: %.02f%%\n", ((float)ht->used/ht->size)*100);
+}
+
 void dictPrintStats(dict *d) {
-    _dictPrintStatsHt(&d->ht[0]);
+    void (*stats)(dictht *ht) =
+        d->open ? _dictOpenPrintStatsHt : _dictPrintStatsHt;
+
+    stats(&d->ht[0]);
     if (dictIsRehashing(d)) {
         printf("-- Rehashing into ht[1]:\n");
-        _dictPrintStatsHt(&d->ht[1]);
+        stats(&d->ht[1]);
+    }
+}
+
+/* ------------------------- open addressing tables ------------------------
+ *
+ * Tables created with dictCreateOpen() store the dictEntry structures
+ * directly in the 'slots' array, with one control byte per slot in 'ctrl'.
+ * A control byte is either EMPTY, DELETED (a tombstone) or, for a full slot,
+ * the low 7 bits of the key hash. Slots are handled in aligned groups of
+ * DICT_GROUP: the upper hash bits select the first group, then groups are
+ * probed with triangular steps, that visit every group of a power of two
+ * table. Inside a group the 16 control bytes are matched at once, so most
+ * lookups compare a single key and touch a single cache line of slots.
+ *
+ * A group that ever became full never gets an EMPTY byte back until the
+ * table is rebuilt, so a lookup can stop at the first group containing an
+ * EMPTY byte: erasing marks the slot EMPTY when its group still has one,
+ * DELETED otherwise. Tombstones count toward the load, and a table mostly
+ * made of tombstones is simply rebuilt at the same size by the usual
+ * incremental rehashing.
+ *
+ * The slots keep no hash, but 'hashes' holds the full hash of every full
+ * slot aside, so that moving the entries to a new table doesn't hash the
+ * keys again. */
+
+#define DICT_GROUP 16
+#define DICT_CTRL_EMPTY 0x80
+#define DICT_CTRL_DELETED 0xFE
+#define DICT_CTRL_FREE(c) ((c) & 0x80)  /* EMPTY or DELETED */
+#define DICT_H1(h) ((h) >> 7)
+#define DICT_H2(h) ((unsigned char)((h) & 0x7f))
+
+/* Bitmask of the slots of the group whose control byte is 'c'. */
+static unsigned int _dictGroupMatch(const unsigned char *ctrl, unsigned char c) {
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g,_mm_set1_epi8((char)c)));
+#else
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP; j++)
+        if (ctrl[j] == c) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+/* Bitmask of the EMPTY or DELETED slots of the group. */
+static unsigned int _dictGroupMatchFree(const unsigned char *ctrl) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+#else
+    unsigned int j, mask = 0;
+
+    for (j = 0; j < DICT_GROUP; j++)
+        if (DICT_CTRL_FREE(ctrl[j])) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+/* Return the slot index of 'key' in 'ht', or -1 if it is not there. */
+static long _dictOpenLookup(dict *d, dictht *ht, const void *key,
+        unsigned int h)
+{
+    unsigned long gmask, g, step;
+    unsigned char h2 = DICT_H2(h);
+
+    if (ht->size == 0) return -1;
+    gmask = ht->size/DICT_GROUP-1;
+    g = DICT_H1(h) & gmask;
+    for (step = 0; step <= gmask; step++) {
+        unsigned char *ctrl = ht->ctrl+g*DICT_GROUP;
+        unsigned int m = _dictGroupMatch(ctrl,h2);
+
+        while (m) {
+            unsigned long idx = g*DICT_GROUP+__builtin_ctz(m);
+
+            if (dictCompareHashKeys(d, key, ht->slots[idx].key))
+                return idx;
+            m &= m-1;
+        }
+        if (_dictGroupMatch(ctrl,DICT_CTRL_EMPTY)) return -1;
+        g = (g+step+1) & gmask;
+    }
+    return -1;
+}
+
+/* Return the first EMPTY or DELETED slot of the probe sequence of 'h', and
+ * mark it as full. Returns -1 only if the table is completely full. */
+static long _dictOpenClaimSlot(dictht *ht, unsigned int h) {
+    unsigned long gmask = ht->size/DICT_GROUP-1, g, step;
+
+    g = DICT_H1(h) & gmask;
+    for (step = 0; step <= gmask; step++) {
+        unsigned int m = _dictGroupMatchFree(ht->ctrl+g*DICT_GROUP);
+
+        if (m) {
+            unsigned long idx = g*DICT_GROUP+__builtin_ctz(m);
+
+            if (ht->ctrl[idx] == DICT_CTRL_DELETED) ht->deleted--;
+            ht->ctrl[idx] = DICT_H2(h);
+            ht->hashes[idx] = h;
+            ht->used++;
+            return idx;
+        }
+        g = (g+step+1) & gmask;
+    }
+    return -1;
+}
+
+static void _dictOpenEraseSlot(dictht *ht, unsigned long idx) {
+    if (_dictGroupMatch(ht->ctrl+(idx & ~(DICT_GROUP-1UL)),DICT_CTRL_EMPTY)) {
+        ht->ctrl[idx] = DICT_CTRL_EMPTY;
+    } else {
+        ht->ctrl[idx] = DICT_CTRL_DELETED;
+        ht->deleted++;
+    }
+    ht->used--;
+}
+
+static int _dictOpenExpand(dict *d, unsigned long size)
+{
+    dictht n;
+    unsigned long realsize = size+size/7+1;
+
+    if (dictIsRehashing(d) || d->ht[0].used > size)
+        return DICT_ERR;
+    if (realsize < DICT_GROUP) realsize = DICT_GROUP;
+    realsize = _dictNextPower(realsize);
+    /* Nothing to gain rebuilding a table of the same size without
+     * tombstones. */
+    if (realsize == d->ht[0].size && d->ht[0].deleted == 0)
+        return DICT_ERR;
+
+    n.table = NULL;
+    n.size = realsize;
+    n.sizemask = realsize-1;
+    n.slots = zcalloc_huge(realsize*sizeof(dictEntry));
+    n.ctrl = zmalloc(realsize);
+    n.hashes = zcalloc_huge(realsize*sizeof(unsigned int));
+    memset(n.ctrl,DICT_CTRL_EMPTY,realsize);
+    n.used = 0;
+    n.deleted = 0;
+
+    if (d->ht[0].ctrl == NULL) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Return 1 if the new table of a rehashing can't take one more entry
+ * without going over 7/8 full once the entries still in ht[0] are moved
+ * into it too. */
+static int _dictOpenTargetFull(dict *d)
+{
+    dictht *t1 = &d->ht[1];
+
+    return (d->ht[0].used+t1->used+t1->deleted+1)*8 > t1->size*7;
+}
+
+/* Move the entries of the new table of a rehashing to one at least twice as
+ * large, with room for the entries still in ht[0], dropping its tombstones.
+ * This costs the size of the new table only, and leaves ht[0] alone, so
+ * unlike rehashing it is allowed while iterating: see dictNext() for the
+ * iterators that were walking the new table. */
+static void _dictOpenGrowTarget(dict *d)
+{
+    dictht *t1 = &d->ht[1], n;
+    unsigned long j;
+
+    n.table = NULL;
+    n.size = _dictNextPower((d->ht[0].used+t1->used+1)*2);
+    if (n.size < t1->size*2) n.size = t1->size*2;
+    n.sizemask = n.size-1;
+    n.slots = zcalloc_huge(n.size*sizeof(dictEntry));
+    n.ctrl = zmalloc(n.size);
+    n.hashes = zcalloc_huge(n.size*sizeof(unsigned int));
+    memset(n.ctrl,DICT_CTRL_EMPTY,n.size);
+    n.used = 0;
+    n.deleted = 0;
+    for (j = 0; j < t1->size; j++) {
+        long idx;
+
+        if (DICT_CTRL_FREE(t1->ctrl[j])) continue;
+        idx = _dictOpenClaimSlot(&n,t1->hashes[j]);
+        n.slots[idx] = t1->slots[j];
+    }
+    zfree(t1->slots);
+    zfree(t1->ctrl);
+    zfree(t1->hashes);
+    *t1 = n;
+}
+
+static int _dictOpenExpandIfNeeded(dict *d)
+{
+    dictht *ht;
+    unsigned long load;
+
+    if (d->ht[0].size == 0) return dictExpand(d, DICT_HT_INITIAL_SIZE);
+    if (dictIsRehashing(d)) {
+        /* The new table would fill up before the old one is drained: grow
+         * it rather than finishing the rehashing of an old table of any
+         * size in a single call. */
+        if (_dictOpenTargetFull(d)) _dictOpenGrowTarget(d);
+        return DICT_OK;
+    }
+    ht = &d->ht[0];
+    load = ht->used+ht->deleted+1;
+    /* Unlike chained tables we can't go past a full table, so the resize
+     * is forced above 15/16 even when dict_can_resize is off. */
+    if ((dict_can_resize && load*8 > ht->size*7) || load*16 > ht->size*15)
+        return dictExpand(d, (ht->used+1)*2);
+    return DICT_OK;
+}
+
+/* Move n groups of slots from the old to the new table, by the hashes
+ * kept aside. */
+static int _dictOpenRehash(dict *d, int n)
+{
+    dictht *t0 = &d->ht[0], *t1 = &d->ht[1];
+    unsigned long from = d->rehashidx;
+
+    while(n--) {
+        unsigned char *ctrl;
+        unsigned long base;
+        unsigned int j, hadempty;
+
+        if (t0->used == 0 ||
+            (unsigned long)d->rehashidx*DICT_GROUP >= t0->size) break;
+
+        base = (unsigned long)d->rehashidx*DICT_GROUP;
+        ctrl = t0->ctrl+base;
+        hadempty = _dictGroupMatch(ctrl,DICT_CTRL_EMPTY) != 0;
+        for (j = 0; j < DICT_GROUP; j++) {
+            dictEntry *de = &t0->slots[base+j];
+            unsigned int h;
+            long idx;
+
+            if (ctrl[j] == DICT_CTRL_DELETED && hadempty) {
+                ctrl[j] = DICT_CTRL_EMPTY;
+                t0->deleted--;
+            }
+            if (DICT_CTRL_FREE(ctrl[j])) continue;
+            /* The adds keep room for ht[0] in the new table, this only
+             * guards against a target sized too small to begin with. */
+            h = t0->hashes[base+j];
+            if ((t1->used+t1->deleted+1)*8 > t1->size*7 ||
+                (idx = _dictOpenClaimSlot(t1,h)) == -1)
+            {
+                _dictOpenGrowTarget(d);
+                idx = _dictOpenClaimSlot(t1,h);
+            }
+            t1->slots[idx] = *de;
+            /* A lookup for a key still in ht[0] may have probed past this
+             * group if it had no EMPTY slot, so leave a tombstone. */
+            if (hadempty) {
+                ctrl[j] = DICT_CTRL_EMPTY;
+            } else {
+                ctrl[j] = DICT_CTRL_DELETED;
+                t0->deleted++;
+            }
+            t0->used--;
+        }
+        d->rehashidx++;
+    }
+    if (t0->used == 0 || (unsigned long)d->rehashidx*DICT_GROUP >= t0->size) {
+        zfree(t0->slots);
+        zfree(t0->ctrl);
+        zfree(t0->hashes);
+        *t0 = *t1;
+        _dictReset(t1);
+        d->rehashidx = -1;
+        return 0;
+    }
+    /* Only the slots and hashes: the ctrl bytes of the groups moved are
+     * still probed by the lookups of the keys left in ht[0]. */
+    _dictReleaseRehashed(t0->slots,sizeof(dictEntry)*DICT_GROUP,
+                         from,d->rehashidx);
+    _dictReleaseRehashed(t0->hashes,sizeof(unsigned int)*DICT_GROUP,
+                         from,d->rehashidx);
+    return 1;
+}
+
+static int _dictOpenAdd(dict *d, void *key, void *val)
+{
+    unsigned int h;
+    dictht *ht;
+    dictEntry *de;
+    long idx;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    if (_dictOpenExpandIfNeeded(d) == DICT_ERR) return DICT_ERR;
+    h = dictHashKey(d, key);
+    if (_dictOpenLookup(d,&d->ht[0],key,h) != -1) return DICT_ERR;
+    if (dictIsRehashing(d) && _dictOpenLookup(d,&d->ht[1],key,h) != -1)
+        return DICT_ERR;
+    /* While rehashing new keys go straight into the new table */
+    ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    if ((idx = _dictOpenClaimSlot(ht,h)) == -1) {
+        /* The load checks above keep both tables from filling up */
+        if (!dictIsRehashing(d)) return DICT_ERR;
+        _dictOpenGrowTarget(d);
+        idx = _dictOpenClaimSlot(ht,h);
+    }
+    de = &ht->slots[idx];
+    dictSetHashKey(d, de, key);
+    dictSetHashVal(d, de, val);
+    return DICT_OK;
+}
+
+static dictEntry *_dictOpenFind(dict *d, const void *key, unsigned int h)
+{
+    unsigned int table;
+    long idx;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    for (table = 0; table <= 1; table++) {
+        idx = _dictOpenLookup(d,&d->ht[table],key,h);
+        if (idx != -1) return &d->ht[table].slots[idx];
+        if (!dictIsRehashing(d)) break;
+    }
+    return NULL;
+}
+
+/* Prefetch the control bytes of the first group probed for 'h', or the
+ * slot of the first control byte matching it. */
+static void _dictOpenPrefetch(dictht *ht, unsigned int h, int entry)
+{
+    unsigned long g = DICT_H1(h) & (ht->size/DICT_GROUP-1);
+    unsigned int m;
+
+    if (!entry) {
+        __builtin_prefetch(ht->ctrl+g*DICT_GROUP);
+        return;
+    }
+    m = _dictGroupMatch(ht->ctrl+g*DICT_GROUP,DICT_H2(h));
+    if (m) __builtin_prefetch(&ht->slots[g*DICT_GROUP+__builtin_ctz(m)]);
+}
+
+static int _dictOpenDelete(dict *d, const void *key, int nofree)
+{
+    unsigned int h, table;
+    long idx;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        dictht *ht = &d->ht[table];
+
+        idx = _dictOpenLookup(d,ht,key,h);
+        if (idx != -1) {
+            if (!nofree) {
+                dictFreeEntryKey(d, &ht->slots[idx]);
+                dictFreeEntryVal(d, &ht->slots[idx]);
+            }
+            _dictOpenEraseSlot(ht,idx);
+            return DICT_OK;
+        }
+        if (!dictIsRehashing(d)) break;
+    }
+    return DICT_ERR; /* not found */
+}
+
+static void _dictOpenClear(dict *d, dictht *ht)
+{
+    unsigned long i;
+
+    for (i = 0; i < ht->size && ht->used > 0; i++) {
+        if (DICT_CTRL_FREE(ht->ctrl[i])) continue;
+        dictFreeEntryKey(d, &ht->slots[i]);
+        dictFreeEntryVal(d, &ht->slots[i]);
+        ht->used--;
+    }
+    zfree(ht->slots);
+    zfree(ht->ctrl);
+    zfree(ht->hashes);
+    _dictReset(ht);
+}
+
+static dictEntry *_dictOpenRandomKey(dict *d)
+{
+    unsigned long i;
+
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    while (1) {
+        if (dictIsRehashing(d)) {
+            i = random() % (d->ht[0].size+d->ht[1].size);
+            if (i >= d->ht[0].size) {
+                i -= d->ht[0].size;
+                if (!DICT_CTRL_FREE(d->ht[1].ctrl[i]))
+                    return &d->ht[1].slots[i];
+                continue;
+            }
+        } else {
+            i = random() & d->ht[0].sizemask;
+        }
+        if (!DICT_CTRL_FREE(d->ht[0].ctrl[i])) return &d->ht[0].slots[i];
     }
 }
 
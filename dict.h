@@ -49,9 +49,11 @@ typedef struct redisServer redisServer;
 typedef struct dictEntry {
     void *key;
     void *val;
-    struct dictEntry *next;
 } dictEntry;
 
+/* Entry of a chained table, defined in dict.c */
+struct dictChainEntry;
+
 typedef struct dictType {
     unsigned int (*hashFunction)(const void *key);
     void *(*keyDup)(void *privdata, const void *key);
@@ -62,12 +64,20 @@ typedef struct dictType {
 } dictType;
 
 /* This is our hash table structure. Every dictionary has two of this as we
- * implement incremental rehashing, for the old to the new table. */
+ * implement incremental rehashing, for the old to the new table.
+ *
+ * Dicts created with dictCreateOpen() use open addressing instead of
+ * chaining: entries live in 'slots', and 'ctrl' holds one control byte per
+ * slot (empty, deleted, or 7 bits of the hash) probed 16 at a time. */
 typedef struct dictht {
-    dictEntry **table;
+    struct dictChainEntry **table;
+    dictEntry *slots;
+    unsigned char *ctrl;
+    unsigned int *hashes;   /* dictHashKey() of the key of each slot */
     unsigned long size;
     unsigned long sizemask;
     unsigned long used;
+    unsigned long deleted; /* tombstones, open addressing only */
 } dictht;
 
 typedef struct dict {
@@ -76,6 +86,7 @@ typedef struct dict {
     dictht ht[2];
     int rehashidx; /* rehashing not in progress if rehashidx == -1 */
     int iterators; /* number of iterators currently running */
+    int open;      /* open addressing table */
 } dict;
 
 /* If safe is set to 1 this is a safe iteartor, that means, you can call
@@ -85,9 +96,12 @@ typedef struct dict {
 typedef struct dictIterator {
     dict *d;
     int table, index, safe;
-    dictEntry *entry, *nextEntry;
+    unsigned long size; /* of the open table walked, to notice it grew */
+    struct dictChainEntry *entry, *nextEntry;
 } dictIterator;
 
+typedef void dictScanFunction(void *privdata, const dictEntry *de);
+
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
@@ -129,6 +143,7 @@ typedef struct dictIterator {
 
 /* API */
 dict *dictCreate(dictType *type, void *privDataPtr);
+dict *dictCreateOpen(dictType *type, void *privDataPtr);
 int dictExpand(dict *d, unsigned long size);
 int dictAdd(dict *d, void *key, void *val);
 int dictReplace(dict *d, void *key, void *val);
@@ -138,6 +153,9 @@ int dictDelete(dict *d, const void *key);
 int dictDeleteNoFree(dict *d, const void *key);
 void dictRelease(dict *d);
 dictEntry * dictFind(dict *d, const void *key);
+dictEntry *dictFindWithHash(dict *d, const void *key, unsigned int h);
+unsigned int dictGetHash(dict *d, const void *key);
+void dictPrefetch(dict *d, unsigned int h, int entry);
 void *dictFetchValue(dict *d, const void *key);
 int dictResize(dict *d);
 dictIterator *dictGetIterator(dict *d);
@@ -145,9 +163,11 @@ dictIterator *dictGetSafeIterator(dict *d);
 dictEntry *dictNext(dictIterator *iter);
 void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *d);
+unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);
 void dictPrintStats(dict *d);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
 unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
+void dictSetHashFunctionSeed(const unsigned char *seed);
 void dictEmpty(dict *d);
 void dictEnableResize(void);
 void dictDisableResize(void);
@@ -0,0 +1,231 @@
+#include "redis.h"
+#include <pthread.h>
+
+/* Freeing a big value (a list, set, zset or hash with millions of
+ * elements) takes long enough to stall the thread running the command.
+ * Values of the keyspace with more than server->lazyfree_threshold
+ * elements are only unlinked by the caller, and freed by a background
+ * thread started on first use.
+ *
+ * The elements of a linked list, a hash table or a zset are objects that
+ * LRANGE, HGETALL, SMEMBERS or ZRANGE share with the reply by reference
+ * count, and SINTERSTORE, SORT ... STORE and the like with other keys. The
+ * count isn't atomic, so before queueing the value the caller gives it a
+ * private copy of every element also referenced from elsewhere, see
+ * lazyfreeUnshareElements(): the thread then only drops references nobody
+ * else has.
+ *
+ * The thread frees every value with the malloc dbnum of the thread that
+ * deleted it, so the memory is given back to the right db. This needs
+ * zmalloc in thread safe mode: otherwise values are always freed in
+ * place. */
+
+typedef struct lazyfreeJob {
+    struct lazyfreeJob *next;
+    robj *o;
+    int dbnum;
+} lazyfreeJob;
+
+static pthread_mutex_t lazyfree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lazyfree_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t lazyfree_thread;
+static int lazyfree_started = 0;
+static int lazyfree_stop = 0;
+static lazyfreeJob *lazyfree_head = NULL, *lazyfree_tail = NULL;
+static size_t lazyfree_pending = 0;     /* queued or being freed */
+
+/* Number of allocations freeing the value takes, roughly */
+static size_t lazyfreeEffort(robj *o) {
+    switch (o->type) {
+    case REDIS_LIST:
+        if (o->encoding == REDIS_ENCODING_LINKEDLIST)
+            return listLength((list*)o->ptr);
+        if (o->encoding == REDIS_ENCODING_QUICKLIST)
+            return ((quicklist*)o->ptr)->len;
+        break;
+    case REDIS_SET:
+        if (o->encoding == REDIS_ENCODING_HT)
+            return dictSize((dict*)o->ptr);
+        break;
+    case REDIS_ZSET:
+        return dictSize(((zset*)o->ptr)->dict);
+    case REDIS_HASH:
+        if (o->encoding == REDIS_ENCODING_HT)
+            return dictSize((dict*)o->ptr);
+        break;
+    }
+    return 1;
+}
+
+/* Return 'ele', an element the container holds 'refs' references to, or
+ * a copy of it holding those references if the element is also referenced
+ * from elsewhere. The references to the original are dropped here. */
+static robj *lazyfreePrivateElement(robj *ele, int refs) {
+    robj *dup;
+
+    /* Shared objects are never freed, nor their refcount touched */
+    if (ele->refcount <= refs || ele->refcount == REDIS_SHARED_REFCOUNT)
+        return ele;
+    if (sdsEncodedObject(ele)) {
+        dup = dupStringObject(ele);
+    } else {
+        dup = createObject(REDIS_STRING,ele->ptr);
+        dup->encoding = ele->encoding;
+    }
+    dup->refcount = refs;
+    ele->refcount -= refs;
+    return dup;
+}
+
+/* Make every element of 'o' referenced by 'o' only. This reads the refcount
+ * of every element, which is much cheaper than freeing them, and only
+ * allocates for the elements that are shared, usually none. */
+static void lazyfreeUnshareElements(robj *o) {
+    dictIterator *di;
+    dictEntry *de;
+
+    switch (o->type) {
+    case REDIS_LIST:
+        if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+            listIter li;
+            listNode *ln;
+
+            listRewind(o->ptr,&li);
+            while ((ln = listNext(&li)) != NULL)
+                listNodeValue(ln) = lazyfreePrivateElement(listNodeValue(ln),1);
+        }
+        break;
+    case REDIS_SET:
+    case REDIS_HASH:
+        if (o->encoding != REDIS_ENCODING_HT) break;
+        di = dictGetIterator(o->ptr);
+        while ((de = dictNext(di)) != NULL) {
+            dictGetEntryKey(de) = lazyfreePrivateElement(dictGetEntryKey(de),1);
+            if (o->type == REDIS_HASH)
+                dictGetEntryVal(de) =
+                    lazyfreePrivateElement(dictGetEntryVal(de),1);
+        }
+        dictReleaseIterator(di);
+        break;
+    case REDIS_ZSET: {
+        zset *zs = o->ptr;
+        zskiplistNode *x = zs->zsl->header->level[0].forward;
+
+        /* The element is both the key of the dict and the object of the
+         * skiplist node. */
+        for (; x != NULL; x = x->level[0].forward) {
+            robj *ele = lazyfreePrivateElement(x->obj,2);
+
+            if (ele == x->obj) continue;
+            de = dictFind(zs->dict,x->obj);
+            redisAssert(de != NULL);
+            dictGetEntryKey(de) = ele;
+            x->obj = ele;
+        }
+        break;
+    }
+    }
+}
+
+static void *lazyfreeMain(void *arg) {
+    REDIS_NOTUSED(arg);
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    while (1) {
+        lazyfreeJob *job;
+
+        while (lazyfree_head == NULL && !lazyfree_stop)
+            pthread_cond_wait(&lazyfree_job_cond,&lazyfree_mutex);
+        if (lazyfree_head == NULL) break;
+        job = lazyfree_head;
+        lazyfree_head = job->next;
+        if (lazyfree_head == NULL) lazyfree_tail = NULL;
+        pthread_mutex_unlock(&lazyfree_mutex);
+
+        set_malloc_dbnum(job->dbnum);
+        decrRefCount(job->o);
+        zfree(job);
+        /* Don't keep the freed memory in this thread's pending delta */
+        zmalloc_flush_stat();
+
+        pthread_mutex_lock(&lazyfree_mutex);
+        if (--lazyfree_pending == 0)
+            pthread_cond_broadcast(&lazyfree_done_cond);
+    }
+    pthread_mutex_unlock(&lazyfree_mutex);
+    return NULL;
+}
+
+/* Release a reference to 'o', a value of the keyspace. The value is freed
+ * by the background thread if this is the last reference and it is big
+ * enough to be worth it. */
+void lazyfreeObject(redisServer *server, robj *o) {
+    lazyfreeJob *job;
+
+    if (o->refcount != 1 || server->lazyfree_threshold == 0 ||
+        !zmalloc_thread_safeness() ||
+        lazyfreeEffort(o) <= server->lazyfree_threshold)
+    {
+        decrRefCount(o);
+        return;
+    }
+
+    lazyfreeUnshareElements(o);
+    job = zmalloc(sizeof(*job));
+    job->next = NULL;
+    job->o = o;
+    job->dbnum = get_malloc_dbnum();
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    if (!lazyfree_started) {
+        if (pthread_create(&lazyfree_thread,NULL,lazyfreeMain,NULL) != 0) {
+            pthread_mutex_unlock(&lazyfree_mutex);
+            redisLog(REDIS_WARNING,"Can't create the lazy free thread");
+            zfree(job);
+            decrRefCount(o);
+            return;
+        }
+        lazyfree_started = 1;
+    }
+    if (lazyfree_tail) lazyfree_tail->next = job;
+    else lazyfree_head = job;
+    lazyfree_tail = job;
+    lazyfree_pending++;
+    pthread_cond_signal(&lazyfree_job_cond);
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+/* Number of values queued or being freed by the background thread */
+size_t lazyfreePendingObjects(void) {
+    size_t pending;
+
+    pthread_mutex_lock(&lazyfree_mutex);
+    pending = lazyfree_pending;
+    pthread_mutex_unlock(&lazyfree_mutex);
+    return pending;
+}
+
+/* Wait until every value queued so far is freed */
+void lazyfreeDrain(void) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    while (lazyfree_pending)
+        pthread_cond_wait(&lazyfree_done_cond,&lazyfree_mutex);
+    pthread_mutex_unlock(&lazyfree_mutex);
+}
+
+/* Free what is queued and terminate the background thread */
+void lazyfreeStop(void) {
+    pthread_mutex_lock(&lazyfree_mutex);
+    if (!lazyfree_started) {
+        pthread_mutex_unlock(&lazyfree_mutex);
+        return;
+    }
+    lazyfree_stop = 1;
+    pthread_cond_signal(&lazyfree_job_cond);
+    pthread_mutex_unlock(&lazyfree_mutex);
+
+    pthread_join(lazyfree_thread,NULL);
+    lazyfree_started = 0;
+    lazyfree_stop = 0;
+}
@@ -11,8 +11,17 @@ int listMatchObjects(void *a, void *b) {
 }
 
 redisClient *createClient(struct redisServer *server) {
-    redisClient *c = zmalloc(sizeof(redisClient));
-    if (!c) return NULL;
+    redisClient *c;
+
+    /* Clients outlive the reset of the db arenas */
+    zmalloc_arena_suspend();
+    c = zmalloc(sizeof(redisClient));
+    if (!c) {
+        zmalloc_arena_resume();
+        return NULL;
+    }
+    listAddNodeTail(server->clients,c);
+    zmalloc_arena_resume();
     c->server = server;
     selectDb(c,0);
     c->old_dbnum = 0;
@@ -20,7 +29,9 @@ redisClient *createClient(struct redisServer *server) {
     c->argc = 0;
     c->argv = NULL;
     c->cmd = NULL;
-    listAddNodeTail(server->clients,c);
+    c->reply_arena = NULL;
+    c->reply_mode = REDIS_REPLY_LIST;
+    c->reply_flat = NULL;
     return c;
 }
 
@@ -62,6 +73,8 @@ void freeClient(struct redisServer *server, redisClient *c) {
     listDelNode(server->clients,ln);
     
     /* Release memory */
+    freeValueItemArena(c->reply_arena);
+    freeValueItemFlat(c->reply_flat);
     zfree(c->argv);
     zfree(c);
 }
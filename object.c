@@ -3,7 +3,7 @@
 #include <math.h>
 
 robj *createObject(int type, void *ptr) {
-    robj *o = zmalloc(sizeof(*o));
+    robj *o = zpool_alloc(sizeof(*o));
     o->type = type;
     o->encoding = REDIS_ENCODING_RAW;
     o->ptr = ptr;
@@ -26,6 +26,38 @@ robj *createStringObject(char *ptr, size_t len, uint16_t logiclock, uint16_t ver
     return createObject(REDIS_STRING,sdsnewlen(ptr,len,logiclock,version));
 }
 
+#define embeddedStringObjectSize(len) \
+    (sizeof(robj)+sizeof(struct sdshdr)+(len)+1)
+
+/* Create a string object with encoding REDIS_ENCODING_EMBSTR: the sds header
+ * and body follow the robj in the same allocation. The sds can't be resized,
+ * so these objects are only used for values that are never modified. */
+robj *createEmbeddedStringObject(char *ptr, size_t len, uint16_t logiclock, uint16_t version) {
+    robj *o = zpool_alloc(embeddedStringObjectSize(len));
+    struct sdshdr *sh = (void*)(o+1);
+
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sh->buf;
+    o->refcount = 1;
+    o->lru = shared.lruclock;
+
+    sh->logiclock = logiclock;
+    sh->version = version;
+    sh->len = len;
+    sh->free = 0;
+    if (ptr) memcpy(sh->buf,ptr,len);
+    sh->buf[len] = '\0';
+    return o;
+}
+
+/* Size given to zpool_alloc() for the object, see createEmbeddedStringObject */
+static size_t objectAllocSize(robj *o) {
+    if (o->encoding == REDIS_ENCODING_EMBSTR)
+        return embeddedStringObjectSize(sdslen(o->ptr));
+    return sizeof(*o);
+}
+
 robj *createStringObjectFromLongLong(long long value) {
     robj *o;
     if (value >= 0 && value < REDIS_SHARED_INTEGERS &&
@@ -46,7 +78,7 @@ robj *createStringObjectFromLongLong(long long value) {
 }
 
 robj *dupStringObject(robj *o) {
-    redisAssert(o->encoding == REDIS_ENCODING_RAW);
+    redisAssert(sdsEncodedObject(o));
     return createStringObject(o->ptr,sdslen(o->ptr),sdslogiclock(o->ptr),sdsversion(o->ptr));
 }
 
@@ -65,6 +97,13 @@ robj *createZiplistObject(void) {
     return o;
 }
 
+robj *createQuicklistObject(int fill, int compress) {
+    quicklist *ql = quicklistCreate(fill,compress);
+    robj *o = createObject(REDIS_LIST,ql);
+    o->encoding = REDIS_ENCODING_QUICKLIST;
+    return o;
+}
+
 robj *createSetObject(void) {
     dict *d = dictCreate(&setDictType,NULL);
     robj *o = createObject(REDIS_SET,d);
@@ -114,6 +153,9 @@ void freeListObject(robj *o) {
     case REDIS_ENCODING_ZIPLIST:
         zfree(o->ptr);
         break;
+    case REDIS_ENCODING_QUICKLIST:
+        quicklistRelease(o->ptr);
+        break;
     default:
         redisPanic("Unknown list encoding type");
     }
@@ -157,15 +199,20 @@ void freeHashObject(robj *o) {
 void incrRefCount(robj *o) {
     //printf("*******incrRefCount********encoding %d, refcount %d********\n",
    	//		o->encoding, o->refcount);
-    o->refcount++;
+    if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount++;
 }
 
 void decrRefCount(void *obj) {
     robj *o = obj;
 
     if (o->refcount <= 0) redisPanic("decrRefCount against refcount <= 0");
+    /* Shared objects are used from several threads, including the lazy
+     * free one: their refcount is never touched. */
+    if (o->refcount == REDIS_SHARED_REFCOUNT) return;
 
     if (--(o->refcount) == 0) {
+        size_t size = objectAllocSize(o);
+
         switch(o->type) {
         case REDIS_STRING: freeStringObject(o); break;
         case REDIS_LIST: freeListObject(o); break;
@@ -175,7 +222,7 @@ void decrRefCount(void *obj) {
         default: redisPanic("Unknown object type"); break;
         }
         o->ptr = NULL; /* defensive programming. We'll see NULL in traces. */
-        zfree(o);
+        zpool_free(o,size);
     }
 }
 
@@ -184,6 +231,7 @@ void decrRefCount(void *obj) {
 //so must be careful of use it
 void forceFreeObject(void *obj) {
 	robj *o = obj;
+	size_t size = objectAllocSize(o);
 
 	//printf("type %d\n", o->type);
 
@@ -198,7 +246,7 @@ void forceFreeObject(void *obj) {
 	default: redisPanic("Unknown object type"); break;
 	}
 	o->ptr = NULL;
-	zfree(o);
+	zpool_free(o,size);
 }
 
 int checkType(redisClient *c, robj *o, int type) {
@@ -225,8 +273,17 @@ robj *tryObjectEncoding(robj *o) {
     /* Currently we try to encode only strings */
     redisAssert(o->type == REDIS_STRING);
 
-    /* Check if we can represent this string as a long integer */
-    if (isStringRepresentableAsLong(s,&value) == REDIS_ERR) return o;
+    /* Check if we can represent this string as a long integer, otherwise
+     * move short strings into a single allocation with the object. */
+    if (isStringRepresentableAsLong(s,&value) == REDIS_ERR) {
+        robj *emb;
+
+        if (sdslen(s) > REDIS_ENCODING_EMBSTR_SIZE_LIMIT) return o;
+        emb = createEmbeddedStringObject(s,sdslen(s),sdslogiclock(s),
+                                         sdsversion(s));
+        decrRefCount(o);
+        return emb;
+    }
 
     /* Ok, this object can be encoded...
      *
@@ -250,7 +307,7 @@ robj *tryObjectEncoding(robj *o) {
 robj *getDecodedObject(robj *o) {
     robj *dec;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         incrRefCount(o);
         return o;
     }
@@ -279,14 +336,14 @@ int compareStringObjects(robj *a, robj *b) {
     int bothsds = 1;
 
     if (a == b) return 0;
-    if (a->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(a)) {
         ll2string(bufa,sizeof(bufa),(long) a->ptr);
         astr = bufa;
         bothsds = 0;
     } else {
         astr = a->ptr;
     }
-    if (b->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(b)) {
         ll2string(bufb,sizeof(bufb),(long) b->ptr);
         bstr = bufb;
         bothsds = 0;
@@ -301,7 +358,7 @@ int compareStringObjects(robj *a, robj *b) {
  * this function is faster then checking for (compareStringObject(a,b) == 0)
  * because it can perform some more optimization. */
 int equalStringObjects(robj *a, robj *b) {
-    if (a->encoding != REDIS_ENCODING_RAW && b->encoding != REDIS_ENCODING_RAW){
+    if (a->encoding == REDIS_ENCODING_INT && b->encoding == REDIS_ENCODING_INT){
         return a->ptr == b->ptr;
     } else {
         return compareStringObjects(a,b) == 0;
@@ -310,7 +367,7 @@ int equalStringObjects(robj *a, robj *b) {
 
 size_t stringObjectLen(robj *o) {
     redisAssert(o->type == REDIS_STRING);
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
     } else {
         char buf[32];
@@ -327,7 +384,7 @@ int getDoubleFromObject(robj *o, double *target) {
         value = 0;
     } else {
         redisAssert(o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             value = strtod(o->ptr, &eptr);
             if (eptr[0] != '\0' || isnan(value)) return REDIS_ERR;
         } else if (o->encoding == REDIS_ENCODING_INT) {
@@ -349,7 +406,7 @@ int getLongLongFromObject(robj *o, long long *target) {
         value = 0;
     } else {
         redisAssert(o->type == REDIS_STRING);
-        if (o->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(o)) {
             if (sdslen(o->ptr) != strlen(o->ptr)) {
                     return REDIS_ERR;
             }
@@ -390,6 +447,8 @@ char *strEncoding(int encoding) {
     case REDIS_ENCODING_ZIPLIST: return "ziplist";
     case REDIS_ENCODING_INTSET: return "intset";
     case REDIS_ENCODING_SKIPLIST: return "skiplist";
+    case REDIS_ENCODING_EMBSTR: return "embstr";
+    case REDIS_ENCODING_QUICKLIST: return "quicklist";
     default: return "unknown";
     }
 }
@@ -405,6 +464,53 @@ unsigned long estimateObjectIdleTime(robj *o) {
     }
 }
 
+/* ---------------------------- LFU access counter ---------------------------
+ * Under an LFU maxmemory policy o->lru is split in two: the upper 16 bits
+ * are the time, in minutes, the counter was last decremented, the lower 8
+ * bits a logarithmic access counter. On access the counter is incremented
+ * with probability 1/((counter-INIT_VAL)*LOG_FACTOR+1), so that 255 takes
+ * about a million hits, and it loses one unit per REDIS_LFU_DECAY_TIME
+ * minutes without accesses, so that keys that were hot long ago cool down. */
+
+static unsigned long LFUTimeElapsed(unsigned long ldt) {
+    unsigned long now = shared.lfuclock;
+
+    if (now >= ldt) return now-ldt;
+    return 65535-ldt+now;
+}
+
+/* Return the counter of 'o' decremented for the time elapsed since its
+ * last access, without updating the object. */
+unsigned long LFUDecrAndReturn(robj *o) {
+    unsigned long ldt = o->lru >> 8;
+    unsigned long counter = o->lru & 255;
+    unsigned long periods = LFUTimeElapsed(ldt) / REDIS_LFU_DECAY_TIME;
+
+    return periods > counter ? 0 : counter-periods;
+}
+
+static unsigned long LFULogIncr(unsigned long counter) {
+    double r, p;
+
+    if (counter == 255) return 255;
+    r = (double)rand()/RAND_MAX;
+    p = counter > REDIS_LFU_INIT_VAL ? counter-REDIS_LFU_INIT_VAL : 0;
+    if (r < 1.0/(p*REDIS_LFU_LOG_FACTOR+1)) counter++;
+    return counter;
+}
+
+/* Account an access to 'o' */
+void updateObjectLFU(robj *o) {
+    unsigned long counter = LFULogIncr(LFUDecrAndReturn(o));
+
+    o->lru = ((unsigned long)shared.lfuclock << 8) | counter;
+}
+
+/* Set the counter of an object just added to the db */
+void initObjectLFU(robj *o) {
+    o->lru = ((unsigned long)shared.lfuclock << 8) | REDIS_LFU_INIT_VAL;
+}
+
 /* This is an helper function for the DEBUG command. We need to lookup keys
  * without any modification of LRU or other parameters. */
 robj *objectCommandLookup(redisClient *c, robj *key) {
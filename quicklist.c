@@ -0,0 +1,603 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "quicklist.h"
+#include "ziplist.h"
+#include "zmalloc.h"
+#include "lzf.h"
+
+/* Bytes an entry may take in a ziplist besides its value: the previous
+ * entry length and the encoding, at most 5 bytes each. */
+#define QUICKLIST_ENTRY_OVERHEAD 10
+
+/* Nodes smaller than this are not worth compressing, and compression must
+ * save at least QUICKLIST_MIN_SAVING bytes to be kept. */
+#define QUICKLIST_MIN_COMPRESS_BYTES 48
+#define QUICKLIST_MIN_SAVING 8
+
+quicklist *quicklistCreate(int fill, int compress) {
+    quicklist *ql = zmalloc(sizeof(*ql));
+
+    ql->head = ql->tail = NULL;
+    ql->count = 0;
+    ql->len = 0;
+    ql->fill = fill > 0 ? fill : 1;
+    ql->compress = compress > 0 ? compress : 0;
+    ql->hot = NULL;
+    ql->height = 0;
+    return ql;
+}
+
+/* Allocate an empty node with a random number of skip levels */
+static quicklistNode *_quicklistAllocNode(void) {
+    quicklistNode *node;
+    int height = 0;
+
+    while (height < QUICKLIST_MAXLEVEL &&
+           (random()&0xFFFF) < (QUICKLIST_SKIP_P * 0xFFFF)) height++;
+    node = zpool_alloc(sizeof(*node)+height*sizeof(struct quicklistSkip));
+    node->prev = node->next = NULL;
+    node->zl = NULL;
+    node->count = 0;
+    node->sz = 0;
+    node->encoding = QUICKLIST_NODE_RAW;
+    node->recompress = 0;
+    node->height = height;
+    node->hot = NULL;
+    return node;
+}
+
+static quicklistNode *_quicklistCreateNode(unsigned char *zl) {
+    quicklistNode *node = _quicklistAllocNode();
+
+    node->zl = zl ? zl : ziplistNew();
+    node->count = ziplistLen(node->zl);
+    node->sz = ziplistSize(node->zl);
+    return node;
+}
+
+static void _quicklistFreeNode(quicklistNode *node) {
+    zfree(node->zl);
+    zpool_free(node,
+        sizeof(*node)+node->height*sizeof(struct quicklistSkip));
+}
+
+void quicklistRelease(quicklist *ql) {
+    quicklistNode *node = ql->head, *next;
+
+    while (node) {
+        next = node->next;
+        _quicklistFreeNode(node);
+        node = next;
+    }
+    zfree(ql);
+}
+
+/* Replace the ziplist of a raw node with its compressed form. Return 0 if
+ * it is too small or doesn't compress well enough, the node is then left
+ * alone. */
+static int _quicklistCompressNode(quicklistNode *node) {
+    quicklistLZF *lzf;
+
+    if (node->encoding != QUICKLIST_NODE_RAW ||
+        node->sz < QUICKLIST_MIN_COMPRESS_BYTES) return 0;
+    lzf = zmalloc(sizeof(*lzf)+node->sz);
+    lzf->sz = lzf_compress(node->zl,node->sz,lzf->compressed,
+                           node->sz-QUICKLIST_MIN_SAVING);
+    if (lzf->sz == 0) {
+        zfree(lzf);
+        return 0;
+    }
+    lzf = zrealloc(lzf,sizeof(*lzf)+lzf->sz);
+    zfree(node->zl);
+    node->zl = (unsigned char*)lzf;
+    node->encoding = QUICKLIST_NODE_LZF;
+    return 1;
+}
+
+static void _quicklistDecompressNode(quicklistNode *node) {
+    quicklistLZF *lzf = (quicklistLZF*)node->zl;
+    unsigned char *zl = zmalloc(node->sz);
+
+    if (lzf_decompress(lzf->compressed,lzf->sz,zl,node->sz) != node->sz)
+        assert(NULL);
+    zfree(lzf);
+    node->zl = zl;
+    node->encoding = QUICKLIST_NODE_RAW;
+}
+
+/* Queue a raw node to be compressed by quicklistRecompress() */
+static void _quicklistQueueNode(quicklist *ql, quicklistNode *node) {
+    if (ql->compress == 0 || node->recompress) return;
+    node->recompress = 1;
+    node->hot = ql->hot;
+    ql->hot = node;
+}
+
+/* Make the ziplist of the node accessible. A compressed node is queued to
+ * be compressed again. */
+static void _quicklistAccessNode(quicklist *ql, quicklistNode *node) {
+    if (node->encoding == QUICKLIST_NODE_RAW) return;
+    _quicklistDecompressNode(node);
+    _quicklistQueueNode(ql,node);
+}
+
+/* Drop a node about to be freed from the recompress queue */
+static void _quicklistForgetNode(quicklist *ql, quicklistNode *node) {
+    quicklistNode **p = &ql->hot;
+
+    if (!node->recompress) return;
+    while (*p != node) p = &(*p)->hot;
+    *p = node->hot;
+}
+
+/* Is the node one of the 'compress' nodes at either end? */
+static int _quicklistNodeAtEnds(quicklist *ql, quicklistNode *node) {
+    quicklistNode *prev = node, *next = node;
+    int i;
+
+    for (i = 0; i < ql->compress; i++) {
+        prev = prev->prev;
+        next = next->next;
+        if (prev == NULL || next == NULL) return 1;
+    }
+    return 0;
+}
+
+/* Restore the layout after nodes were added or removed: the nodes at the
+ * ends are decompressed for good, and the first interior node of each side,
+ * the one that may just have left an end, is compressed. */
+static void _quicklistCompressEnds(quicklist *ql) {
+    quicklistNode *fwd = ql->head, *rev = ql->tail;
+    int i;
+
+    if (ql->compress == 0) return;
+    if (ql->len <= (unsigned long)ql->compress*2) {
+        for (; fwd; fwd = fwd->next)
+            if (fwd->encoding == QUICKLIST_NODE_LZF)
+                _quicklistDecompressNode(fwd);
+        return;
+    }
+    for (i = 0; i < ql->compress; i++) {
+        if (fwd->encoding == QUICKLIST_NODE_LZF) _quicklistDecompressNode(fwd);
+        if (rev->encoding == QUICKLIST_NODE_LZF) _quicklistDecompressNode(rev);
+        fwd = fwd->next;
+        rev = rev->prev;
+    }
+    /* Nodes queued for recompression are left to quicklistRecompress() */
+    if (!fwd->recompress) _quicklistCompressNode(fwd);
+    if (rev != fwd && !rev->recompress) _quicklistCompressNode(rev);
+}
+
+/* Compress again the interior nodes decompressed to be accessed. Entries
+ * point into the ziplist of their node: only call this when none of the
+ * entries returned so far is referenced anymore. */
+void quicklistRecompress(quicklist *ql) {
+    quicklistNode *node = ql->hot, *next;
+
+    while (node) {
+        next = node->hot;
+        node->recompress = 0;
+        node->hot = NULL;
+        if (!_quicklistNodeAtEnds(ql,node)) _quicklistCompressNode(node);
+        node = next;
+    }
+    ql->hot = NULL;
+}
+
+/* Next node and span of skip level j of node x, of the header when x is
+ * NULL. Both can be assigned. */
+#define _quicklistSkipNext(ql,x,j) \
+    (*((x) ? &(x)->skip[j].next : &(ql)->skipnext[j]))
+#define _quicklistSkipSpan(ql,x,j) \
+    (*((x) ? &(x)->skip[j].span : &(ql)->skipspan[j]))
+
+/* For every skip level in use, find the last node up to 'node' that has
+ * the level, NULL for the header, and the entries from it up to 'node'. */
+static void _quicklistSkipPath(quicklist *ql, quicklistNode *node,
+                               quicklistNode **update, unsigned long *dist)
+{
+    quicklistNode *x = node, *back;
+    unsigned long d = 0;
+    int j;
+
+    for (j = 0; j < ql->height; j++) {
+        while (x && x->height <= j) {
+            if (j == 0) {
+                back = x->prev;
+                d += back ? back->count : 0;
+            } else {
+                back = x->skip[j-1].back;
+                d += _quicklistSkipSpan(ql,back,j-1);
+            }
+            x = back;
+        }
+        update[j] = x;
+        dist[j] = d;
+    }
+}
+
+/* Add 'delta' entries to the count of the node and to the spans over it */
+static void _quicklistNodeCountAdd(quicklist *ql, quicklistNode *node,
+                                   long delta)
+{
+    quicklistNode *update[QUICKLIST_MAXLEVEL];
+    unsigned long dist[QUICKLIST_MAXLEVEL];
+    int j;
+
+    _quicklistSkipPath(ql,node,update,dist);
+    for (j = 0; j < ql->height; j++)
+        _quicklistSkipSpan(ql,update[j],j) += delta;
+    node->count += delta;
+    ql->count += delta;
+}
+
+/* Link 'node' next to 'old', after or before it. With no 'old' the list
+ * must be empty. */
+static void _quicklistLinkNode(quicklist *ql, quicklistNode *old,
+                               quicklistNode *node, int after)
+{
+    quicklistNode *update[QUICKLIST_MAXLEVEL];
+    unsigned long dist[QUICKLIST_MAXLEVEL];
+    unsigned int count = node->count;
+    int height = node->height, j;
+
+    if (old == NULL) {
+        ql->head = ql->tail = node;
+    } else if (after) {
+        node->prev = old;
+        node->next = old->next;
+        if (old->next) old->next->prev = node;
+        else ql->tail = node;
+        old->next = node;
+    } else {
+        node->next = old;
+        node->prev = old->prev;
+        if (old->prev) old->prev->next = node;
+        else ql->head = node;
+        old->prev = node;
+    }
+    ql->len++;
+
+    /* Link it in the skip list with no entries, so no span changes, and
+     * add them after. */
+    node->count = 0;
+    node->height = 0;
+    while (ql->height < height) {
+        ql->skipnext[ql->height] = NULL;
+        ql->skipspan[ql->height] = ql->count;
+        ql->height++;
+    }
+    _quicklistSkipPath(ql,node,update,dist);
+    for (j = 0; j < height; j++) {
+        quicklistNode *next = _quicklistSkipNext(ql,update[j],j);
+
+        node->skip[j].next = next;
+        node->skip[j].back = update[j];
+        node->skip[j].span = _quicklistSkipSpan(ql,update[j],j)-dist[j];
+        if (next) next->skip[j].back = node;
+        _quicklistSkipNext(ql,update[j],j) = node;
+        _quicklistSkipSpan(ql,update[j],j) = dist[j];
+    }
+    node->height = height;
+    _quicklistNodeCountAdd(ql,node,count);
+}
+
+/* Unlink the node, left with no entries. */
+static void _quicklistUnlinkNode(quicklist *ql, quicklistNode *node) {
+    int j;
+
+    _quicklistNodeCountAdd(ql,node,-(long)node->count);
+    for (j = 0; j < node->height; j++) {
+        quicklistNode *back = node->skip[j].back, *next = node->skip[j].next;
+
+        _quicklistSkipSpan(ql,back,j) += node->skip[j].span;
+        _quicklistSkipNext(ql,back,j) = next;
+        if (next) next->skip[j].back = back;
+    }
+    while (ql->height && ql->skipnext[ql->height-1] == NULL) ql->height--;
+
+    if (node->prev) node->prev->next = node->next;
+    else ql->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else ql->tail = node->prev;
+    ql->len--;
+    _quicklistForgetNode(ql,node);
+}
+
+/* Copy the nodes as they are, compressed or not. */
+quicklist *quicklistDup(quicklist *ql) {
+    quicklist *copy = quicklistCreate(ql->fill,ql->compress);
+    quicklistNode *node, *n;
+
+    for (node = ql->head; node; node = node->next) {
+        size_t size = (node->encoding == QUICKLIST_NODE_LZF) ?
+            sizeof(quicklistLZF)+((quicklistLZF*)node->zl)->sz : node->sz;
+
+        n = _quicklistAllocNode();
+        n->zl = zmalloc(size);
+        memcpy(n->zl,node->zl,size);
+        n->count = node->count;
+        n->sz = node->sz;
+        n->encoding = node->encoding;
+        _quicklistLinkNode(copy,copy->tail,n,1);
+        if (node->recompress) _quicklistQueueNode(copy,n);
+    }
+    return copy;
+}
+
+/* Can a value of 'slen' bytes be added to the node? */
+static int _quicklistNodeAllowInsert(quicklist *ql, quicklistNode *node,
+                                     unsigned int slen)
+{
+    return node != NULL && node->count < (unsigned int)ql->fill &&
+           node->sz+slen+QUICKLIST_ENTRY_OVERHEAD <= QUICKLIST_MAX_NODE_BYTES;
+}
+
+static void _quicklistNodePush(quicklist *ql, quicklistNode *node,
+                               unsigned char *s, unsigned int slen, int where)
+{
+    _quicklistAccessNode(ql,node);
+    node->zl = ziplistPush(node->zl,s,slen,
+        where == QUICKLIST_HEAD ? ZIPLIST_HEAD : ZIPLIST_TAIL);
+    node->sz = ziplistSize(node->zl);
+    _quicklistNodeCountAdd(ql,node,1);
+}
+
+/* Add the value at the head or the tail. Only a full end node gets a new
+ * node next to it. */
+void quicklistPush(quicklist *ql, unsigned char *s, unsigned int slen,
+                   int where)
+{
+    quicklistNode *node = (where == QUICKLIST_HEAD) ? ql->head : ql->tail;
+
+    if (!_quicklistNodeAllowInsert(ql,node,slen)) {
+        quicklistNode *n = _quicklistCreateNode(NULL);
+
+        _quicklistLinkNode(ql,node,n,where == QUICKLIST_TAIL);
+        _quicklistCompressEnds(ql);
+        node = n;
+    }
+    _quicklistNodePush(ql,node,s,slen,where);
+}
+
+/* Find the node holding the entry at 'index' (negative from the tail),
+ * going down the skip list, and the offset of the entry in it. */
+static quicklistNode *_quicklistLocate(quicklist *ql, long index,
+                                       int *offset)
+{
+    quicklistNode *x = NULL, *next;
+    unsigned long i, rank = 0;
+    int j;
+
+    if (index < 0) index += ql->count;
+    if (index < 0 || (unsigned long)index >= ql->count) return NULL;
+    i = index;
+    for (j = ql->height-1; j >= 0; j--) {
+        while ((next = _quicklistSkipNext(ql,x,j)) != NULL &&
+               rank+_quicklistSkipSpan(ql,x,j) <= i)
+        {
+            rank += _quicklistSkipSpan(ql,x,j);
+            x = next;
+        }
+    }
+    if (x == NULL) x = ql->head;
+    while (rank+x->count <= i) {
+        rank += x->count;
+        x = x->next;
+    }
+    *offset = i-rank;
+    return x;
+}
+
+static void _quicklistFillEntry(quicklistEntry *entry, quicklistNode *node,
+                                unsigned char *zi, int offset)
+{
+    entry->node = node;
+    entry->zi = zi;
+    entry->offset = offset;
+    entry->vstr = NULL;
+    ziplistGet(zi,&entry->vstr,&entry->vlen,&entry->vlong);
+}
+
+/* Get the entry at 'index', negative from the tail. Return 0 if out of
+ * range. */
+int quicklistIndex(quicklist *ql, long index, quicklistEntry *entry) {
+    quicklistNode *node;
+    int offset;
+
+    if ((node = _quicklistLocate(ql,index,&offset)) == NULL) return 0;
+    _quicklistAccessNode(ql,node);
+    _quicklistFillEntry(entry,node,ziplistIndex(node->zl,offset),offset);
+    return 1;
+}
+
+/* Replace the value of the entry, that is not valid anymore. */
+void quicklistReplaceEntry(quicklist *ql, quicklistEntry *entry,
+                           unsigned char *s, unsigned int slen)
+{
+    quicklistNode *node = entry->node;
+    unsigned char *p = entry->zi;
+
+    (void)ql;
+    node->zl = ziplistDelete(node->zl,&p);
+    node->zl = ziplistInsert(node->zl,p,s,slen);
+    node->sz = ziplistSize(node->zl);
+}
+
+/* Move the entries from 'offset' on of the node to a new node after it. */
+static void _quicklistSplitNode(quicklist *ql, quicklistNode *node,
+                                int offset)
+{
+    size_t size = node->sz;
+    unsigned char *zl = zmalloc(size);
+    unsigned int moved = node->count-offset;
+
+    memcpy(zl,node->zl,size);
+    zl = ziplistDeleteRange(zl,0,offset);
+    node->zl = ziplistDeleteRange(node->zl,offset,moved);
+    node->sz = ziplistSize(node->zl);
+    _quicklistNodeCountAdd(ql,node,-(long)moved);
+    _quicklistLinkNode(ql,node,_quicklistCreateNode(zl),1);
+}
+
+/* Insert the value after or before the entry, that is not valid anymore.
+ * A full node spills into its neighbour when the value goes at its edge,
+ * else it is split in two. */
+void quicklistInsert(quicklist *ql, quicklistEntry *entry,
+                     unsigned char *s, unsigned int slen, int after)
+{
+    quicklistNode *node = entry->node, *n;
+    int atedge = after ? entry->offset == (int)node->count-1 :
+                         entry->offset == 0;
+
+    if (_quicklistNodeAllowInsert(ql,node,slen)) {
+        unsigned char *p = entry->zi;
+
+        if (after) p = ziplistNext(node->zl,p);
+        if (p == NULL) {
+            node->zl = ziplistPush(node->zl,s,slen,ZIPLIST_TAIL);
+        } else {
+            node->zl = ziplistInsert(node->zl,p,s,slen);
+        }
+        node->sz = ziplistSize(node->zl);
+        _quicklistNodeCountAdd(ql,node,1);
+        return;
+    } else if (atedge) {
+        n = after ? node->next : node->prev;
+        if (!_quicklistNodeAllowInsert(ql,n,slen)) {
+            n = _quicklistCreateNode(NULL);
+            _quicklistLinkNode(ql,node,n,after);
+            _quicklistQueueNode(ql,n);
+        }
+        _quicklistNodePush(ql,n,s,slen,
+            after ? QUICKLIST_HEAD : QUICKLIST_TAIL);
+    } else {
+        /* The node keeps what comes before the value, that is pushed on
+         * its tail. */
+        _quicklistSplitNode(ql,node,after ? entry->offset+1 : entry->offset);
+        _quicklistQueueNode(ql,node->next);
+        _quicklistNodePush(ql,node,s,slen,QUICKLIST_TAIL);
+    }
+    _quicklistCompressEnds(ql);
+}
+
+/* Delete 'count' entries from 'start' on, negative from the tail. Whole
+ * nodes in the range are unlinked without touching their entries. */
+void quicklistDelRange(quicklist *ql, long start, unsigned long count) {
+    quicklistNode *node, *next;
+    unsigned long len = ql->len;
+    int offset;
+
+    if ((node = _quicklistLocate(ql,start,&offset)) == NULL) return;
+    while (node && count) {
+        unsigned long del = node->count-offset;
+
+        if (del > count) del = count;
+        next = node->next;
+        if (offset == 0 && del == node->count) {
+            _quicklistUnlinkNode(ql,node);
+            _quicklistFreeNode(node);
+        } else {
+            _quicklistAccessNode(ql,node);
+            node->zl = ziplistDeleteRange(node->zl,offset,del);
+            node->sz = ziplistSize(node->zl);
+            _quicklistNodeCountAdd(ql,node,-(long)del);
+        }
+        count -= del;
+        offset = 0;
+        node = next;
+    }
+    if (ql->len != len) _quicklistCompressEnds(ql);
+}
+
+/* Initialize the iterator at the entry 'index', negative from the tail,
+ * moving towards the tail or the head. Return 0 if out of range: the
+ * iterator then returns nothing. */
+int quicklistInitIterator(quicklist *ql, quicklistIter *iter, long index,
+                          int direction)
+{
+    iter->ql = ql;
+    iter->direction = direction;
+    iter->zi = NULL;
+    iter->node = _quicklistLocate(ql,index,&iter->offset);
+    if (iter->node == NULL) return 0;
+    _quicklistAccessNode(ql,iter->node);
+    iter->zi = ziplistIndex(iter->node->zl,iter->offset);
+    return 1;
+}
+
+/* Store the next entry in 'entry'. Return 0 when there are no more. */
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+    quicklistNode *node = iter->node;
+    unsigned char *next;
+
+    if (node == NULL) return 0;
+    if (iter->zi == NULL) {
+        /* Entering a new node */
+        _quicklistAccessNode(iter->ql,node);
+        if (iter->direction == QUICKLIST_TAIL) {
+            iter->offset = 0;
+            iter->zi = ziplistIndex(node->zl,0);
+        } else {
+            iter->offset = node->count-1;
+            iter->zi = ziplistIndex(node->zl,-1);
+        }
+    }
+    _quicklistFillEntry(entry,node,iter->zi,iter->offset);
+
+    if (iter->direction == QUICKLIST_TAIL) {
+        next = ziplistNext(node->zl,iter->zi);
+        iter->offset++;
+        if (next == NULL) iter->node = node->next;
+    } else {
+        next = ziplistPrev(node->zl,iter->zi);
+        iter->offset--;
+        if (next == NULL) iter->node = node->prev;
+    }
+    iter->zi = next;
+    return 1;
+}
+
+/* Delete the entry just returned by quicklistNext(), keeping the iterator
+ * valid. */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    quicklist *ql = iter->ql;
+    quicklistNode *node = entry->node;
+    unsigned char *p = entry->zi;
+
+    if (node->count == 1) {
+        iter->node = (iter->direction == QUICKLIST_TAIL) ?
+                     node->next : node->prev;
+        iter->zi = NULL;
+        _quicklistUnlinkNode(ql,node);
+        _quicklistFreeNode(node);
+        _quicklistCompressEnds(ql);
+        return;
+    }
+
+    node->zl = ziplistDelete(node->zl,&p);
+    node->sz = ziplistSize(node->zl);
+    _quicklistNodeCountAdd(ql,node,-1);
+    if (iter->direction == QUICKLIST_TAIL) {
+        if (entry->offset == (int)node->count) {
+            iter->node = node->next;
+            iter->zi = NULL;
+        } else {
+            iter->node = node;
+            iter->zi = p;
+            iter->offset = entry->offset;
+        }
+    } else {
+        if (entry->offset == 0) {
+            iter->node = node->prev;
+            iter->zi = NULL;
+        } else {
+            iter->node = node;
+            iter->zi = ziplistPrev(node->zl,p);
+            iter->offset = entry->offset-1;
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef __QUICKLIST_H
+#define __QUICKLIST_H
+
+/* A doubly linked list of ziplists: every node holds up to 'fill' entries
+ * and QUICKLIST_MAX_NODE_BYTES bytes, so a list of any length keeps the
+ * density of a ziplist, while a push or pop only ever touches the small
+ * ziplist of one of the ends. */
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL 1
+#define QUICKLIST_MAX_NODE_BYTES 8192
+
+/* With a compress depth of N the N nodes at each end are kept as plain
+ * ziplists, the nodes in between are stored LZF compressed: long lists are
+ * mostly accessed at the ends. An interior node is decompressed when it is
+ * accessed, and compressed again by quicklistRecompress(). */
+#define QUICKLIST_NODE_RAW 1
+#define QUICKLIST_NODE_LZF 2
+
+/* The nodes are also linked in a skip list whose spans count entries, so
+ * the node holding an index is found in O(log(N)) instead of walking the
+ * list from one end. */
+#define QUICKLIST_MAXLEVEL 16
+#define QUICKLIST_SKIP_P 0.25
+
+typedef struct quicklistNode {
+    struct quicklistNode *prev;
+    struct quicklistNode *next;
+    unsigned char *zl;          /* ziplist, or quicklistLZF when compressed */
+    unsigned int count;         /* entries of zl */
+    unsigned int sz;            /* bytes of the ziplist, even if compressed */
+    unsigned char encoding;     /* QUICKLIST_NODE_RAW or QUICKLIST_NODE_LZF */
+    unsigned char recompress;   /* decompressed for an access */
+    unsigned char height;       /* skip levels above the node list */
+    struct quicklistNode *hot;  /* next node to recompress */
+    struct quicklistSkip {
+        struct quicklistNode *next;
+        struct quicklistNode *back;     /* NULL for the header */
+        unsigned long span;     /* entries from this node up to next */
+    } skip[];
+} quicklistNode;
+
+typedef struct quicklistLZF {
+    unsigned int sz;            /* bytes of compressed */
+    char compressed[];
+} quicklistLZF;
+
+typedef struct quicklist {
+    quicklistNode *head;
+    quicklistNode *tail;
+    unsigned long count;        /* entries of all the nodes */
+    unsigned long len;          /* nodes */
+    int fill;                   /* max entries per node */
+    int compress;               /* raw nodes at each end, 0 to never compress */
+    quicklistNode *hot;         /* nodes to recompress */
+    int height;                 /* skip levels in use */
+    quicklistNode *skipnext[QUICKLIST_MAXLEVEL];    /* skip list header */
+    unsigned long skipspan[QUICKLIST_MAXLEVEL];
+} quicklist;
+
+/* An entry, as returned by quicklistIndex() and quicklistNext(). The value
+ * is either the string vstr/vlen or, when vstr is NULL, the integer vlong,
+ * and points into the ziplist: it is valid until the list is modified. */
+typedef struct quicklistEntry {
+    quicklistNode *node;
+    unsigned char *zi;
+    int offset;                 /* of zi in node */
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+} quicklistEntry;
+
+typedef struct quicklistIter {
+    quicklist *ql;
+    quicklistNode *node;
+    unsigned char *zi;          /* next entry, NULL to start at node */
+    int offset;                 /* of the next entry in node */
+    int direction;              /* QUICKLIST_HEAD: towards the head */
+} quicklistIter;
+
+quicklist *quicklistCreate(int fill, int compress);
+quicklist *quicklistDup(quicklist *ql);
+void quicklistRelease(quicklist *ql);
+void quicklistPush(quicklist *ql, unsigned char *s, unsigned int slen,
+                   int where);
+int quicklistIndex(quicklist *ql, long index, quicklistEntry *entry);
+void quicklistReplaceEntry(quicklist *ql, quicklistEntry *entry,
+                           unsigned char *s, unsigned int slen);
+void quicklistInsert(quicklist *ql, quicklistEntry *entry,
+                     unsigned char *s, unsigned int slen, int after);
+void quicklistDelRange(quicklist *ql, long start, unsigned long count);
+int quicklistInitIterator(quicklist *ql, quicklistIter *iter, long index,
+                          int direction);
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry);
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry);
+void quicklistRecompress(quicklist *ql);
+
+#endif // __QUICKLIST_H
@@ -174,6 +174,26 @@ void dictRedisObjectDestructor(void *privdata, void *val)
     decrRefCount(val);
 }
 
+/* Values of db->dict, the dict privdata is the server */
+void dictLazyFreeObjectDestructor(void *privdata, void *val)
+{
+    if (val == NULL) return;
+    if (privdata == NULL) {
+        decrRefCount(val);
+    } else {
+        lazyfreeObject(privdata,val);
+    }
+}
+
+/* Values of db->expires: unlink the node from the expire wheel */
+void dictExpireNodeDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    twRemove(val);
+    zpool_free(val,sizeof(twNode));
+}
+
 void dictSdsDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
@@ -222,7 +242,7 @@ int dictEncObjKeyCompare(void *privdata, const void *key1,
 unsigned int dictEncObjHash(const void *key) {
     robj *o = (robj*) key;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
     } else {
         if (o->encoding == REDIS_ENCODING_INT) {
@@ -269,7 +289,7 @@ dictType dbDictType = {
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictRedisObjectDestructor   /* val destructor */
+    dictLazyFreeObjectDestructor /* val destructor */
 };
 
 /* Db->expires */
@@ -279,7 +299,7 @@ dictType keyptrDictType = {
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
     NULL,                      /* key destructor */
-    NULL                       /* val destructor */
+    dictExpireNodeDestructor   /* val destructor */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -323,39 +343,14 @@ int htNeedsResize(dict *dict) {
             (used*100/size < REDIS_HT_MINFILL));
 }
 
-/* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
- * we resize the hash table to save memory */
-void tryResizeHashTables(redisServer *server) {
-    int j;
-
-    int dbnum = get_malloc_dbnum();
-    for (j = 0; j < server->dbnum; j++) {
-        set_malloc_dbnum(j);
-        redisDb *db = server->db + j;
-        if (htNeedsResize(db->dict))
-            dictResize(db->dict);
-        if (htNeedsResize(db->expires))
-            dictResize(db->expires);
-    }
-    set_malloc_dbnum(dbnum);
-}
-
-/* Our hash table implementation performs rehashing incrementally while
- * we write/read from the hash table. Still if the server is idle, the hash
- * table will use two tables for a long time. So we try to use 1 millisecond
- * of CPU time at every serverCron() loop in order to rehash some key. */
-void incrementallyRehash(redisServer *server) {
-    int j;
+/* The dbs left without keys give their keyspace back */
+void releaseIdleDbs(redisServer *server) {
+    int j = 0;
 
-    int dbnum = get_malloc_dbnum();
-    for (j = 0; j < server->dbnum; j++) {
-        set_malloc_dbnum(j);
-        if (dictIsRehashing(server->db[j].dict)) {
-            dictRehashMilliseconds(server->db[j].dict,1);
-            break; /* already used our millisecond for this loop... */
-        }
+    while (j < server->active_dbnum) {
+        /* The last active db takes the place of a released one */
+        if (!releaseIdleDb(server->db + server->active_db[j])) j++;
     }
-    set_malloc_dbnum(dbnum);
 }
 
 /* This function is called once a background process of some kind terminates,
@@ -371,71 +366,223 @@ void updateDictResizePolicy(redisServer *server) {
 
 
 void updateLRUClock() {
-    shared.lruclock = (time(NULL)/REDIS_LRU_CLOCK_RESOLUTION) &
+    time_t now = time(NULL);
+
+    shared.lruclock = (now/REDIS_LRU_CLOCK_RESOLUTION) &
                                                 REDIS_LRU_CLOCK_MAX;
+    shared.lfuclock = (now/60) & 65535;
 }
 
-void activeExpireCycle(struct redisServer *server) {
+/* Expires are checked against shared.mstime instead of reading the clock
+ * at every lookup. serverCron() anchors the monotonic clock to the UNIX
+ * time, then refreshCachedTime() only reads the monotonic clock before
+ * every command, so the cached time does not jump back and forth with
+ * the wall clock between two crons. */
+void updateCachedTime(void) {
+    shared.mstime_offset = mstime() - monotime();
+    refreshCachedTime();
+}
+
+void refreshCachedTime(void) {
+    shared.mstime = monotime() + shared.mstime_offset;
+}
+
+/* Delete at most 'budget' keys of the db that are due, in expire time
+ * order, stopping early once ustime() reaches 'deadline' (0 for none).
+ * Keys expire when now > when, see expireIfNeeded(). Return the number
+ * of keys deleted. */
+static long activeExpireDb(redisDb *db, long budget, long long deadline) {
+    long long now = shared.mstime;
+    long expired = 0;
+    twNode *n;
+
+    if (db->expire_wheel == NULL) return 0;
+    if (dictSize(db->expires) == 0 && db->expire_wheel->now < now-1)
+        db->expire_wheel->now = now-1; /* nothing to walk through */
+    while (expired < budget && (n = twPopDue(db->expire_wheel,now-1)) != NULL) {
+        sds key = n->data;
+        if (db->logiclock > sdslogiclock(key)) {
+            db->need_remove_key--;
+        }
+        robj *keyobj = createStringObject(key,sdslen(key),sdslogiclock(key),sdsversion(key));
+        dbDelete(db,keyobj);
+        decrRefCount(keyobj);
+        db->stat_expiredkeys++;
+        expired++;
+        if (deadline && (expired & 31) == 0 && ustime() >= deadline) break;
+    }
+    return expired;
+}
+
+/* Bumping db->logiclock invalidates all the keys of the db at once, and
+ * need_remove_key counts the stale keys left. Besides the lazy deletion
+ * of the stale keys touched, they are swept in the background: a pass
+ * walks the whole dict with dictScan(), deleting the stale keys it meets,
+ * and is resumed from its cursor at every call. A new pass is started as
+ * long as stale keys are left. */
+
+typedef struct sweepBatch {
+    redisDb *db;
+    sds *keys;
+    int count, size;
+} sweepBatch;
+
+static void sweepScanCallback(void *privdata, const dictEntry *de) {
+    sweepBatch *b = privdata;
+    sds key = dictGetEntryKey(de);
+
+    b->db->stat_sweep_scanned++;
+    if (b->db->logiclock <= sdslogiclock(key)) return;
+    if (b->count == b->size) {
+        b->size = b->size ? b->size*2 : 16;
+        b->keys = zrealloc(b->keys,sizeof(sds)*b->size);
+    }
+    b->keys[b->count++] = key;
+}
+
+/* Run at most 'steps' dictScan() steps of the stale key sweep of the db.
+ * Return the number of stale keys deleted. */
+static long sweepStaleKeys(redisDb *db, int steps) {
+    sweepBatch b;
+    long reclaimed = 0;
     int j;
-    uint16_t logiclock;
-    long num;
-    dictEntry *de;
 
+    if (!db->sweep_running) {
+        if (db->need_remove_key == 0) return 0;
+        db->sweep_running = 1;
+        db->sweep_cursor = 0;
+        db->stat_sweep_scanned = 0;
+        db->stat_sweep_reclaimed = 0;
+        redisLog(REDIS_VERBOSE,"DB %d: sweeping %zu stale keys",
+            db->id,db->need_remove_key);
+    }
+
+    b.db = db;
+    b.keys = NULL;
+    b.size = 0;
+    while (steps--) {
+        /* The keys are deleted after the step, as the dict can't be
+         * modified during dictScan(). Deleting them does not move the
+         * keys collected but not deleted yet. */
+        b.count = 0;
+        db->sweep_cursor = dictScan(db->dict,db->sweep_cursor,
+                                    sweepScanCallback,&b);
+        for (j = 0; j < b.count; j++) {
+            sds key = b.keys[j];
+            robj *keyobj = createStringObject(key,sdslen(key),
+                    sdslogiclock(key),sdsversion(key));
+            dbDelete(db,keyobj);
+            decrRefCount(keyobj);
+            if (db->need_remove_key) db->need_remove_key--;
+            db->stat_expiredkeys++;
+        }
+        reclaimed += b.count;
+        if (db->sweep_cursor == 0) break;
+    }
+    zfree(b.keys);
+    db->stat_sweep_reclaimed += reclaimed;
+
+    if (db->sweep_cursor == 0) {
+        db->sweep_running = 0;
+        redisLog(REDIS_VERBOSE,"DB %d: stale key sweep done, %lld keys "
+            "scanned, %lld reclaimed, %zu left",db->id,
+            db->stat_sweep_scanned,db->stat_sweep_reclaimed,
+            db->need_remove_key);
+        /* A whole pass found nothing: the count is off, the keys are gone */
+        if (db->stat_sweep_reclaimed == 0) db->need_remove_key = 0;
+    }
+    return reclaimed;
+}
+
+/* Background work on the keyspace is bounded by server->cron_budget
+ * microseconds per serverCron() call. The dbs are visited round robin from
+ * server->cron_db, the db after the one the previous call stopped at, so
+ * every db gets its turn even when a few of them take the whole budget.
+ *
+ * A db gets db->expire_effort keys expired per visit: the effort doubles
+ * while the db has more keys due than it gets, and halves back when it
+ * has few. Stale keys and rehashing take whatever time is left, and the
+ * dbs with work pending are visited again while the budget lasts. */
+
+/* Work on the db until 'deadline'. Return 1 if work is left. */
+static int databaseCron(struct redisServer *server, redisDb *db,
+                        long long deadline)
+{
+    long effort = db->expire_effort;
+    long expired;
+    int pending = 0;
+
+    expired = activeExpireDb(db,effort,deadline);
+    if (expired < effort && ustime() >= deadline) {
+        pending = 1; /* cut short, tells nothing about the db */
+    } else if (expired == effort) {
+        if (effort < REDIS_EXPIRE_EFFORT_MAX)
+            db->expire_effort = effort*2;
+        pending = 1;
+    } else if (expired < effort/4 && effort > REDIS_EXPIRE_EFFORT_MIN) {
+        db->expire_effort = effort/2;
+    }
+
+    while ((db->need_remove_key > 0 || db->sweep_running) &&
+           ustime() < deadline)
+        sweepStaleKeys(db,REDIS_SWEEP_STEPS);
+    if (db->need_remove_key > 0 || db->sweep_running) pending = 1;
+
+    /* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
+     * we resize the hash table to save memory. The shrink is a rehashing
+     * like any other, done in steps by the accesses to the table and
+     * here. */
+    if (htNeedsResize(db->dict)) dictResize(db->dict);
+    if (htNeedsResize(db->expires)) dictResize(db->expires);
+
+    /* Our hash table implementation performs rehashing incrementally while
+     * we write/read from the hash table. Still if the server is idle, the
+     * hash table will use two tables for a long time, so some buckets are
+     * moved here as well, for a slice of the budget per visit. */
+    if (server->activerehashing) {
+        long long until = ustime()+server->cron_budget/REDIS_CRON_ROUNDS;
+
+        if (until > deadline) until = deadline;
+        while (dictIsRehashing(db->dict) && ustime() < until)
+            dictRehash(db->dict,REDIS_REHASH_STEPS);
+        while (dictIsRehashing(db->expires) && ustime() < until)
+            dictRehash(db->expires,REDIS_REHASH_STEPS);
+        if (dictIsRehashing(db->dict) || dictIsRehashing(db->expires))
+            pending = 1;
+    }
+    return pending;
+}
+
+static int databaseHasWork(struct redisServer *server, redisDb *db) {
+    return db->expire_wheel != NULL || db->need_remove_key > 0 ||
+           db->sweep_running ||
+           htNeedsResize(db->dict) || htNeedsResize(db->expires) ||
+           (server->activerehashing &&
+            (dictIsRehashing(db->dict) || dictIsRehashing(db->expires)));
+}
+
+void activeExpireCycle(struct redisServer *server) {
+    long long deadline;
     int dbnum = get_malloc_dbnum();
-    for (j = 0; j < server->dbnum; j++) {
-        set_malloc_dbnum(j);
-        int expired;
-        redisDb *db = server->db+j;
-
-        do {
-            num = db->need_remove_key;
-
-            expired = 0;
-            if (num > REDIS_EXPIRELOOKUPS_PER_CRON)
-                num = REDIS_EXPIRELOOKUPS_PER_CRON;
-            while (num--) {
-                if ((de = dictGetRandomKey(db->dict)) == NULL) break;
-                sds key = dictGetEntryKey(de);
-                logiclock = sdslogiclock(key);
-                if (db->logiclock > logiclock) {
-                    robj *keyobj = createStringObject(key,sdslen(key),sdslogiclock(key),sdsversion(key));
-                    dbDelete(db,keyobj);
-                    decrRefCount(keyobj);
-                    expired++;
-                    db->need_remove_key--;
-                    db->stat_expiredkeys++;
-                }
-            }
-        } while (expired > REDIS_EXPIRELOOKUPS_PER_CRON/4);
-
-        /* Continue to expire if at the end of the cycle more than 25%
-         * of the keys were expired. */
-        do {
-            num = dictSize(db->expires);
-            time_t now = time(NULL);
-
-            expired = 0;
-            if (num > REDIS_EXPIRELOOKUPS_PER_CRON)
-                num = REDIS_EXPIRELOOKUPS_PER_CRON;
-            while (num--) {
-                time_t t;
-
-                if ((de = dictGetRandomKey(db->expires)) == NULL) break;
-                t = (time_t) dictGetEntryVal(de);
-                if (now > t) {
-                    sds key = dictGetEntryKey(de);
-                    logiclock = sdslogiclock(key);
-                    if (db->logiclock > logiclock) {
-                        db->need_remove_key--;
-                    }
-                    robj *keyobj = createStringObject(key,sdslen(key),sdslogiclock(key),sdsversion(key));
-                    dbDelete(db,keyobj);
-                    decrRefCount(keyobj);
-                    expired++;
-                    db->stat_expiredkeys++;
-                }
+    int j, rounds, pending = 1;
+
+    if (server->cron_budget <= 0) return;
+    deadline = ustime()+server->cron_budget;
+    for (rounds = 0; pending && rounds < REDIS_CRON_ROUNDS; rounds++) {
+        pending = 0;
+        for (j = 0; j < server->active_dbnum; j++) {
+            redisDb *db;
+
+            if (server->cron_db >= server->active_dbnum) server->cron_db = 0;
+            db = server->db+server->active_db[server->cron_db++];
+            if (!databaseHasWork(server,db)) continue;
+            set_malloc_dbnum(db->id);
+            pending |= databaseCron(server,db,deadline);
+            if (ustime() >= deadline) {
+                set_malloc_dbnum(dbnum);
+                return;
             }
-        } while (expired > REDIS_EXPIRELOOKUPS_PER_CRON/4);
+        }
     }
     set_malloc_dbnum(dbnum);
 }
@@ -459,19 +606,20 @@ int serverCron(struct redisServer *server) {
      * REDIS_LRU_CLOCK_RESOLUTION define.
      */
     updateLRUClock();
+    updateCachedTime();
 
     /* Show some info about non-empty databases */
-    for (j = 0; j < server->dbnum; j++) {
-        long long size = dictSlots(server->db[j].dict);
-        long long used = dictSize(server->db[j].dict);
-        long long vkeys = dictSize(server->db[j].expires);
-        if (!(loops % 50) && (used || vkeys)) {
-            redisLog(REDIS_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
+    for (j = 0; !(loops % 50) && j < server->active_dbnum; j++) {
+        redisDb *db = server->db+server->active_db[j];
+        long long size = dictSlots(db->dict);
+        long long used = dictSize(db->dict);
+        long long vkeys = dictSize(db->expires);
+        if (used || vkeys) {
+            redisLog(REDIS_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",db->id,used,vkeys,size);
         }
     }
 
-    if (!(loops % 10)) tryResizeHashTables(server);
-    if (server->activerehashing) incrementallyRehash(server);
+    if (!(loops % 10)) releaseIdleDbs(server);
 
     /* Show information about connected clients */
     if (!(loops % 50)) {
@@ -492,10 +640,12 @@ int serverCron(struct redisServer *server) {
 
 void createSharedObjects() {
     updateLRUClock();
+    updateCachedTime();
     int j;
     for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
         shared.integers[j] = createObject(REDIS_STRING,(void*)(long)j);
         shared.integers[j]->encoding = REDIS_ENCODING_INT;
+        shared.integers[j]->refcount = REDIS_SHARED_REFCOUNT;
     }
 }
 
@@ -509,11 +659,41 @@ void freeSharedObjects() {
 	}
 }
 
+/* Seed the dict hash function once per process, before any dict exists.
+ * Falls back to time and pid when /dev/urandom is not available. */
+static void initHashFunctionSeed(void) {
+    static int seeded = 0;
+    unsigned char seed[16];
+    FILE *fp;
+
+    if (seeded) return;
+    fp = fopen("/dev/urandom","r");
+    if (fp == NULL || fread(seed,sizeof(seed),1,fp) != 1) {
+        struct timeval tv;
+        unsigned long long x;
+        int j;
+
+        gettimeofday(&tv,NULL);
+        x = (unsigned long long)tv.tv_sec ^
+            ((unsigned long long)tv.tv_usec << 20) ^
+            ((unsigned long long)getpid() << 40);
+        for (j = 0; j < (int)sizeof(seed); j++) {
+            x = x*6364136223846793005ULL + 1442695040888963407ULL;
+            seed[j] = (unsigned char)(x >> 56);
+        }
+    }
+    if (fp) fclose(fp);
+    dictSetHashFunctionSeed(seed);
+    seeded = 1;
+}
+
 void initServer(redisServer *server) {
+    initHashFunctionSeed();
     server->hash_max_zipmap_entries = REDIS_HASH_MAX_ZIPMAP_ENTRIES;
     server->hash_max_zipmap_value = REDIS_HASH_MAX_ZIPMAP_VALUE;
     server->list_max_ziplist_entries = REDIS_LIST_MAX_ZIPLIST_ENTRIES;
     server->list_max_ziplist_value = REDIS_LIST_MAX_ZIPLIST_VALUE;
+    server->list_compress_depth = REDIS_LIST_COMPRESS_DEPTH;
     server->set_max_intset_entries = REDIS_SET_MAX_INTSET_ENTRIES;
 
     server->dbnum = MAX_DBNUM;
@@ -521,6 +701,9 @@ void initServer(redisServer *server) {
     server->maxmemory_policy = REDIS_MAXMEMORY_ALLKEYS_LRU;
     server->maxmemory_samples = 3;
     server->activerehashing = 1;
+    server->cron_budget = REDIS_CRON_BUDGET;
+    server->cron_db = 0;
+    server->lazyfree_threshold = REDIS_LAZYFREE_THRESHOLD;
 
     /* Double constants initialization */
     R_Zero = 0.0;
@@ -532,13 +715,20 @@ void initServer(redisServer *server) {
     server->clients = listCreate();
 
     server->db = zmalloc(sizeof(redisDb)*server->dbnum);
+    server->active_db = zmalloc(sizeof(int)*server->dbnum);
+    server->active_dbnum = 0;
+    server->emptydict = dictCreateOpen(&dbDictType,server);
+    server->emptyexpires = dictCreateOpen(&keyptrDictType,NULL);
     for (j = 0; j < server->dbnum; j++) {
         memset(&(server->db[j]), 0, sizeof(redisDb));
-        server->db[j].dict = dictCreate(&dbDictType,NULL);
-        server->db[j].expires = dictCreate(&keyptrDictType,NULL);
+        server->db[j].dict = server->emptydict;
+        server->db[j].expires = server->emptyexpires;
         server->db[j].id = j;
+        server->db[j].server = server;
+        server->db[j].active_idx = -1;
         server->db[j].maxmemory = REDIS_DEFAULT_DB_MAX_MEMOERY;
         server->db[j].maxmemory_samples = server->maxmemory_samples;
+        server->db[j].maxmemory_policy = REDIS_MAXMEMORY_VOLATILE_LRU;
 
         server->db[j].stat_evictedkeys = 0;
         server->db[j].stat_expiredkeys = 0;
@@ -548,9 +738,12 @@ void initServer(redisServer *server) {
         server->db[j].read_count = 0;
         server->db[j].hit_count = 0;
         server->db[j].remove_count = 0;
+        server->db[j].replies = 0;
 
         server->db[j].logiclock = 1;
         server->db[j].need_remove_key = 0;
+        server->db[j].sweep_running = 0;
+        server->db[j].expire_effort = REDIS_EXPIRE_EFFORT_MIN;
     }
     server->dirty = 0;
     server->stat_numcommands = 0;
@@ -562,11 +755,22 @@ void initServer(redisServer *server) {
 void unInitServer(redisServer* server) {
 	int j = 0;
 
-	for(j = 0; j < server->dbnum; j++) {
-		dictRelease(server->db[j].dict);
-		dictRelease(server->db[j].expires);
+	for(j = 0; j < server->active_dbnum; j++) {
+		redisDb *db = server->db+server->active_db[j];
+
+		dictRelease(db->dict);
+		dictRelease(db->expires);
+		if (db->expire_wheel)
+			twRelease(db->expire_wheel);
+		evictionPoolRelease(db);
 	}
+	lazyfreeStop();
+	for(j = 0; j < server->dbnum; j++)
+		zmalloc_arena_release(j);
 
+	dictRelease(server->emptydict);
+	dictRelease(server->emptyexpires);
+	zfree(server->active_db);
 	zfree(server->db);
 
 	listRelease(server->clients);
@@ -599,6 +803,14 @@ int processCommand(redisClient *c) {
      * a regular command proc. */
     struct redisServer *server = c->server;
 
+    refreshCachedTime();
+
+    /* Expire a few due keys of the db at every command, so the deletions
+     * of keys expiring together are spread between two crons instead of
+     * happening all at the next one. */
+    if (c->db->expire_wheel)
+        activeExpireDb(c->db,REDIS_EXPIRES_PER_COMMAND,0);
+
     /* Handle the maxmemory directive.
      *
      * First we try to free some memory if possible (if there are volatile
@@ -645,6 +857,154 @@ void bytesToHuman(char *s, unsigned long long n) {
 
 /* ============================ Maxmemory directive  ======================== */
 
+/* Every db keeps the REDIS_EVICTION_POOL_SIZE best LRU candidates seen by
+ * the past samplings, sorted by ascending idle time. Each eviction adds
+ * maxmemory_samples fresh samples to the pool and takes out its idlest
+ * key, so keys sampled but not evicted are not thrown away, and the choice
+ * is made among many more keys than a single sampling round sees.
+ *
+ * Entries hold a copy of the key name: the key may be deleted meanwhile,
+ * so it is looked up again before being evicted. Volatile keys and all
+ * keys have separate pools, as the volatile pass must only evict keys
+ * with an expire.
+ *
+ * With LFU the idle time is replaced by 255 minus the decayed access
+ * counter, so the least frequently used keys rank as the idlest. */
+
+static void evictionPoolRemove(evictionPoolEntry *pool, int k) {
+    sdsfree(pool[k].key);
+    memmove(pool+k,pool+k+1,sizeof(*pool)*(REDIS_EVICTION_POOL_SIZE-k-1));
+    pool[REDIS_EVICTION_POOL_SIZE-1].key = NULL;
+}
+
+/* Sample 'samples' keys of db->expires (volatile_only) or db->dict into
+ * the pool. A key invalidated by the logiclock is returned instead, as it
+ * is the best possible candidate. */
+static sds evictionPoolPopulate(redisDb *db, int volatile_only, int lfu,
+                               int samples) {
+    dict *sampledict = volatile_only ? db->expires : db->dict;
+    evictionPoolEntry *pool;
+    int j, k;
+
+    /* Idle times and LFU scores can't be compared */
+    if (db->eviction_pool_lfu != lfu) {
+        evictionPoolRelease(db);
+        db->eviction_pool_lfu = lfu;
+    }
+    pool = db->eviction_pool[!volatile_only];
+    if (pool == NULL) {
+        pool = zmalloc(sizeof(*pool)*REDIS_EVICTION_POOL_SIZE);
+        memset(pool,0,sizeof(*pool)*REDIS_EVICTION_POOL_SIZE);
+        db->eviction_pool[!volatile_only] = pool;
+    }
+    for (j = 0; j < samples; j++) {
+        dictEntry *de = dictGetRandomKey(sampledict);
+        sds key = dictGetEntryKey(de);
+        unsigned long idle;
+
+        if (db->logiclock > sdslogiclock(key)) return key;
+        /* With volatile_only we need an additonal lookup to locate the
+         * real key, as sampledict is set to db->expires. */
+        if (volatile_only) de = dictFind(db->dict,key);
+        if (lfu)
+            idle = 255-LFUDecrAndReturn(dictGetEntryVal(de));
+        else
+            idle = estimateObjectIdleTime(dictGetEntryVal(de));
+
+        for (k = 0; k < REDIS_EVICTION_POOL_SIZE && pool[k].key; k++)
+            if (sdscmp(pool[k].key,key) == 0) break;
+        if (k < REDIS_EVICTION_POOL_SIZE && pool[k].key) continue;
+
+        /* Find the first entry with a greater idle time, or an empty one */
+        k = 0;
+        while (k < REDIS_EVICTION_POOL_SIZE && pool[k].key &&
+               pool[k].idle < idle) k++;
+        if (k == 0 && pool[REDIS_EVICTION_POOL_SIZE-1].key != NULL) {
+            /* Pool full and every entry is a better candidate */
+            continue;
+        } else if (pool[REDIS_EVICTION_POOL_SIZE-1].key == NULL) {
+            /* Room at the end: shift the entries from k to the right */
+            memmove(pool+k+1,pool+k,
+                    sizeof(*pool)*(REDIS_EVICTION_POOL_SIZE-k-1));
+        } else {
+            /* Pool full: drop the least idle entry, shift the ones before
+             * k to the left */
+            k--;
+            sdsfree(pool[0].key);
+            memmove(pool,pool+1,sizeof(*pool)*k);
+        }
+        pool[k].key = sdsdup(key);
+        pool[k].idle = idle;
+    }
+    return NULL;
+}
+
+/* Take the idlest entry still in the db out of the pool, returning the key
+ * as stored in db->dict, or NULL if the pool has none. */
+static sds evictionPoolPop(redisDb *db, int volatile_only) {
+    evictionPoolEntry *pool = db->eviction_pool[!volatile_only];
+    int k;
+
+    if (pool == NULL) return NULL;
+    for (k = REDIS_EVICTION_POOL_SIZE-1; k >= 0; k--) {
+        dictEntry *de;
+        sds key;
+
+        if (pool[k].key == NULL) continue;
+        de = dictFind(db->dict,pool[k].key);
+        if (de != NULL && volatile_only &&
+            dictFind(db->expires,pool[k].key) == NULL) de = NULL;
+        key = de ? dictGetEntryKey(de) : NULL;
+        evictionPoolRemove(pool,k);
+        if (key) return key;
+    }
+    return NULL;
+}
+
+/* Return the LRU (or LFU) eviction candidate of the db among its volatile
+ * keys (volatile_only) or all its keys, or NULL if there is none. */
+static sds evictionPoolBestKey(redisDb *db, int volatile_only, int lfu,
+                               int samples) {
+    dict *d = volatile_only ? db->expires : db->dict;
+    sds key = NULL;
+    int tries;
+
+    if (dictSize(d) == 0) return NULL;
+    /* A second round only if the whole pool was stale */
+    for (tries = 0; tries < 2 && key == NULL; tries++) {
+        if ((key = evictionPoolPopulate(db,volatile_only,lfu,samples)) != NULL)
+            break;
+        key = evictionPoolPop(db,volatile_only);
+    }
+    return key;
+}
+
+void evictionPoolRelease(redisDb *db) {
+    int j, k;
+
+    for (j = 0; j < 2; j++) {
+        if (db->eviction_pool[j] == NULL) continue;
+        for (k = 0; k < REDIS_EVICTION_POOL_SIZE; k++)
+            sdsfree(db->eviction_pool[j][k].key);
+        zfree(db->eviction_pool[j]);
+        db->eviction_pool[j] = NULL;
+    }
+}
+
+/* Delete the key 'key' (as stored in db->dict) on behalf of maxmemory. */
+static void evictKey(redisDb *db, sds key) {
+    robj *keyobj;
+
+    if (db->logiclock > sdslogiclock(key)) {
+        db->need_remove_key--;
+    }
+    keyobj = createStringObject(key,sdslen(key),
+            sdslogiclock(key),sdsversion(key));
+    dbDelete(db,keyobj);
+    db->stat_evictedkeys++;
+    decrRefCount(keyobj);
+}
+
 /* This function gets called when 'maxmemory' is set on the config file to limit
  * the max memory used by the server, and we are out of memory.
  * This function will try to, in order:
@@ -657,30 +1017,17 @@ void bytesToHuman(char *s, unsigned long long n) {
  * memory usage.
  */
 void freeMemoryIfNeeded(struct redisServer *server) {
-    int i;
-    uint16_t logiclock;
-    sds thiskey;
-    for (i = 0; i < server->dbnum; i++) {
-        redisDb *db = server->db+i;
-        if (db->need_remove_key > 0) {
-            struct dictEntry *de;
-            de = dictGetRandomKey(db->dict);
-            if (de == NULL) {
-                continue;
-            }
-            thiskey = dictGetEntryKey(de);
-
-            logiclock = sdslogiclock(thiskey);
-            if (db->logiclock > logiclock) {
-                robj *keyobj = createStringObject(thiskey,sdslen(thiskey),
-                        sdslogiclock(thiskey),sdsversion(thiskey));
-                dbDelete(db,keyobj);
-                db->stat_evictedkeys++;
-                db->need_remove_key--;
-                decrRefCount(keyobj);
-            }
+    int i, dbnum = get_malloc_dbnum();
+
+    /* Stale keys are the first to go */
+    for (i = 0; i < server->active_dbnum; i++) {
+        redisDb *db = server->db+server->active_db[i];
+        if (db->need_remove_key > 0 || db->sweep_running) {
+            set_malloc_dbnum(db->id);
+            sweepStaleKeys(db,1);
         }
     }
+    set_malloc_dbnum(dbnum);
 
     /* Remove keys accordingly to the active policy as long as we are
      * over the memory limit. */
@@ -689,19 +1036,22 @@ void freeMemoryIfNeeded(struct redisServer *server) {
     while (server->maxmemory && zmalloc_used_memory() > server->maxmemory) {
         int j, k, freed = 0;
 
-        for (j = 0; j < server->dbnum; j++) {
-            long bestval = 0; /* just to prevent warning */
+        for (j = 0; j < server->active_dbnum; j++) {
+            long long bestval = 0; /* just to prevent warning */
             sds bestkey = NULL;
             struct dictEntry *de;
-            redisDb *db = server->db+j;
+            redisDb *db = server->db+server->active_db[j];
             dict *dict;
 
+            /* What the eviction allocates and frees is the db's */
+            set_malloc_dbnum(db->id);
             if (server->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
+                server->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LFU ||
                 server->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_RANDOM)
             {
-                dict = server->db[j].dict;
+                dict = db->dict;
             } else {
-                dict = server->db[j].expires;
+                dict = db->expires;
             }
             if (dictSize(dict) == 0) continue;
 
@@ -713,43 +1063,32 @@ void freeMemoryIfNeeded(struct redisServer *server) {
                 bestkey = dictGetEntryKey(de);
             }
 
-            /* volatile-lru and allkeys-lru policy */
+            /* volatile-lru, allkeys-lru, volatile-lfu and allkeys-lfu
+             * policies. Objects only carry the access information the
+             * maxmemory_policy of their db asks for, so that is what keys
+             * are ranked on. */
             else if (server->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
-                server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
+                server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU ||
+                REDIS_MAXMEMORY_IS_LFU(server->maxmemory_policy))
             {
-                for (k = 0; k < server->maxmemory_samples; k++) {
-                    sds thiskey;
-                    long thisval;
-                    robj *o;
-
-                    de = dictGetRandomKey(dict);
-                    thiskey = dictGetEntryKey(de);
-                    /* When policy is volatile-lru we need an additonal lookup
-                     * to locate the real key, as dict is set to db->expires. */
-                    if (server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU)
-                        de = dictFind(db->dict, thiskey);
-                    o = dictGetEntryVal(de);
-                    thisval = estimateObjectIdleTime(o);
-
-                    /* Higher idle time is better candidate for deletion */
-                    if (bestkey == NULL || thisval > bestval) {
-                        bestkey = thiskey;
-                        bestval = thisval;
-                    }
-                }
+                bestkey = evictionPoolBestKey(db,
+                    server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LRU ||
+                    server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_LFU,
+                    REDIS_MAXMEMORY_IS_LFU(db->maxmemory_policy),
+                    server->maxmemory_samples);
             }
 
             /* volatile-ttl */
             else if (server->maxmemory_policy == REDIS_MAXMEMORY_VOLATILE_TTL) {
                 for (k = 0; k < server->maxmemory_samples; k++) {
                     sds thiskey;
-                    long thisval;
+                    long long thisval;
 
                     de = dictGetRandomKey(dict);
                     thiskey = dictGetEntryKey(de);
-                    thisval = (long) dictGetEntryVal(de);
+                    thisval = ((twNode*)dictGetEntryVal(de))->when;
 
-                    /* Expire sooner (minor expire unix timestamp) is better
+                    /* Expire sooner (minor expire unix time in ms) is better
                      * candidate for deletion */
                     if (bestkey == NULL || thisval < bestval) {
                         bestkey = thiskey;
@@ -760,20 +1099,13 @@ void freeMemoryIfNeeded(struct redisServer *server) {
 
             /* Finally remove the selected key. */
             if (bestkey) {
-                logiclock = sdslogiclock(bestkey);
-                if (db->logiclock > logiclock) {
-                    db->need_remove_key--;
-                }
-                robj *keyobj = createStringObject(bestkey,sdslen(bestkey),
-                        sdslogiclock(bestkey),sdsversion(bestkey));
-                dbDelete(db,keyobj);
-                db->stat_evictedkeys++;
-                decrRefCount(keyobj);
+                evictKey(db,bestkey);
                 freed++;
             }
         }
-        if (!freed) return; /* nothing to free... */
+        if (!freed) break; /* nothing to free... */
     }
+    set_malloc_dbnum(dbnum);
 }
 
 int setDBMaxmemory(redisServer *server, int id, uint64_t maxmem) {
@@ -783,68 +1115,64 @@ int setDBMaxmemory(redisServer *server, int id, uint64_t maxmem) {
     return REDIS_OK;
 }
 
+/* Set how the keys of a db are picked when it goes over its maxmemory:
+ * by recency (LRU) or access frequency (LFU), volatile keys first or all
+ * keys alike. */
+int setDBMaxmemoryPolicy(redisServer *server, int id, int policy) {
+    redisDb *db;
 
-int freeDBMemory(redisDb *db, int expires_db) {
-    uint16_t logiclock;
-    dict *dict = NULL;
-    if (expires_db)
-        dict = db->expires;
-    else
-        dict = db->dict;
-
-    if (dictSize(dict) == 0)
-        return 0;
-
-    sds bestkey = NULL;
-    struct dictEntry *de = NULL;
-    long bestval = 0;
-    for (int k = 0; k < db->maxmemory_samples; k++) {
-        sds thiskey;
-        long thisval;
-        robj *o;
-
-        de = dictGetRandomKey(dict);
-        thiskey = dictGetEntryKey(de);
-
-        logiclock = sdslogiclock(thiskey);
-        if (db->logiclock > logiclock) {
-            bestkey = thiskey;
-            break;
-        }
-
-        /* When policy is volatile-lru we need an additonal lookup
-         * to locate the real key, as dict is set to db->expires. */
-        if (expires_db)
-            de = dictFind(db->dict, thiskey);
-        o = dictGetEntryVal(de);
-        thisval = estimateObjectIdleTime(o);
-
-        /* Higher idle time is better candidate for deletion */
-        if (bestkey == NULL || thisval > bestval) {
-            bestkey = thiskey;
-            bestval = thisval;
+    if (id < 0 || id >= server->dbnum)
+        return REDIS_ERR;
+    if (policy != REDIS_MAXMEMORY_VOLATILE_LRU &&
+        policy != REDIS_MAXMEMORY_ALLKEYS_LRU &&
+        policy != REDIS_MAXMEMORY_VOLATILE_LFU &&
+        policy != REDIS_MAXMEMORY_ALLKEYS_LFU)
+        return REDIS_ERR;
+    db = server->db+id;
+    if (REDIS_MAXMEMORY_IS_LFU(policy) !=
+        REDIS_MAXMEMORY_IS_LFU(db->maxmemory_policy))
+    {
+        /* The lru fields hold the other kind of access information, start
+         * every key from scratch */
+        dictIterator *di = dictGetIterator(db->dict);
+        dictEntry *de;
+
+        while((de = dictNext(di)) != NULL) {
+            robj *o = dictGetEntryVal(de);
+
+            if (REDIS_MAXMEMORY_IS_LFU(policy))
+                initObjectLFU(o);
+            else
+                o->lru = shared.lruclock;
         }
+        dictReleaseIterator(di);
     }
+    db->maxmemory_policy = policy;
+    return REDIS_OK;
+}
+
+
+int freeDBMemory(redisDb *db, int expires_db) {
+    sds bestkey = evictionPoolBestKey(db,expires_db,
+            REDIS_MAXMEMORY_IS_LFU(db->maxmemory_policy),
+            db->maxmemory_samples);
+
     /* Finally remove the selected key. */
     if (bestkey) {
-        logiclock = sdslogiclock(bestkey);
-        if (db->logiclock > logiclock) {
-            db->need_remove_key--;
-        }
-        robj *keyobj = createStringObject(bestkey,sdslen(bestkey),sdslogiclock(bestkey),sdsversion(bestkey));
-        dbDelete(db,keyobj);
-        db->stat_evictedkeys++;
-        decrRefCount(keyobj);
+        evictKey(db,bestkey);
         return 1;
     }
     return 0;
 }
 
 void freeDBMemoryIfNeeded(struct redisDb *db) {
-    /* now just support lru, first volatile-lru, second allkeys-lru*/
+    /* The volatile policies evict volatile keys first, then any key */
+    int allkeys = db->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LRU ||
+                  db->maxmemory_policy == REDIS_MAXMEMORY_ALLKEYS_LFU;
+
     while (db->maxmemory && zmalloc_db_used_memory(db->id) > db->maxmemory) {
         int freed = 0;
-        if (freeDBMemory(db, 1))
+        if (!allkeys && freeDBMemory(db, 1))
             freed++;
         else if (freeDBMemory(db, 0))
             freed++;
@@ -23,6 +23,8 @@
 #include "zipmap.h" /* Compact string -> string data structure */
 #include "ziplist.h" /* Compact list data structure */
 #include "intset.h" /* Compact integer set structure */
+#include "timewheel.h" /* Expire times index */
+#include "quicklist.h" /* Lists of ziplists */
 
 #define REDIS_OK_BUT_ALREADY_EXIST			5
 #define REDIS_ERR_EXPIRE_TIME_OUT           4
@@ -63,13 +65,25 @@
 #define REDIS_DEFAULT_DBNUM     16
 #define REDIS_CONFIGLINE_MAX    1024
 #define REDIS_MAX_SYNC_TIME     60      /* Slave can't take more to sync */
-#define REDIS_EXPIRELOOKUPS_PER_CRON    10 /* lookup 10 expires per loop */
+#define REDIS_CRON_BUDGET       2000    /* us of keyspace work per cron */
+#define REDIS_CRON_ROUNDS       8       /* max visits of a db per cron */
+#define REDIS_EXPIRE_EFFORT_MIN 20      /* keys expired per db visit, adapted */
+#define REDIS_EXPIRE_EFFORT_MAX 5120    /* between these two bounds */
+#define REDIS_EXPIRES_PER_COMMAND 4     /* max keys expired per command */
+#define REDIS_REHASH_STEPS      100     /* buckets rehashed per db visit */
+#define REDIS_SWEEP_STEPS 64            /* dictScan() calls between time checks */
+#define REDIS_LAZYFREE_THRESHOLD 64     /* values with more elements are freed in background */
+#define REDIS_LOOKUP_BATCH      32      /* keys prefetched together by MGET */
 #define REDIS_MAX_WRITE_PER_EVENT (1024*64)
 #define REDIS_REQUEST_MAX_SIZE (1024*1024*256) /* max bytes in inline command */
 #define REDIS_SHARED_INTEGERS 10000
+#define REDIS_SHARED_REFCOUNT INT_MAX /* refcount of shared objects, never changed */
 #define REDIS_REPLY_CHUNK_BYTES (5*1500) /* 5 TCP packets with default MTU */
 #define REDIS_MAX_LOGMSG_LEN    1024 /* Default maximum length of syslog messages */
 #define REDIS_DEFAULT_DB_MAX_MEMOERY 1024*1024*10 /* 10MB */
+#define REDIS_REPLY_ARENA_BLOCK_BYTES (1024*4) /* min size of a reply arena block */
+#define REDIS_REPLY_ARENA_MAX_BYTES (1024*1024) /* shrink the arena above this */
+#define REDIS_REPLY_FLAT_INLINE_MAX 128 /* robj strings up to this are copied */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
@@ -105,6 +119,15 @@
 #define REDIS_ENCODING_ZIPLIST 5 /* Encoded as ziplist */
 #define REDIS_ENCODING_INTSET 6  /* Encoded as intset */
 #define REDIS_ENCODING_SKIPLIST 7  /* Encoded as skiplist */
+#define REDIS_ENCODING_EMBSTR 8  /* robj and sds in a single allocation */
+#define REDIS_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
+
+/* String values up to this length are stored as EMBSTR by tryObjectEncoding */
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 64
+
+/* True for string objects whose ptr is an sds (raw or embedded) */
+#define sdsEncodedObject(objptr) ((objptr)->encoding == REDIS_ENCODING_RAW || \
+                                  (objptr)->encoding == REDIS_ENCODING_EMBSTR)
 
 /* Object types only used for dumping to disk */
 #define REDIS_EXPIRETIME 253
@@ -188,6 +211,7 @@
 #define REDIS_HASH_MAX_ZIPMAP_VALUE 64
 #define REDIS_LIST_MAX_ZIPLIST_ENTRIES 512
 #define REDIS_LIST_MAX_ZIPLIST_VALUE 64
+#define REDIS_LIST_COMPRESS_DEPTH 0   /* nodes kept raw at each end, 0 is off */
 #define REDIS_SET_MAX_INTSET_ENTRIES 512
 
 /* Sets operations codes */
@@ -202,6 +226,10 @@
 #define REDIS_MAXMEMORY_ALLKEYS_LRU 3
 #define REDIS_MAXMEMORY_ALLKEYS_RANDOM 4
 #define REDIS_MAXMEMORY_NO_EVICTION 5
+#define REDIS_MAXMEMORY_ALLKEYS_LFU 6
+#define REDIS_MAXMEMORY_VOLATILE_LFU 7
+#define REDIS_MAXMEMORY_IS_LFU(p) ((p) == REDIS_MAXMEMORY_ALLKEYS_LFU || \
+                                   (p) == REDIS_MAXMEMORY_VOLATILE_LFU)
 
 /* We can print the stacktrace, so our assert is defined this way: */
 #define redisAssert(_e) ((_e)?(void)0 : (_redisAssert(#_e,__FILE__,__LINE__),_exit(1)))
@@ -227,6 +255,7 @@ typedef struct value_item_node {
     struct value_item_node* pre;
     struct value_item_node* next;
     int8_t type;/* NODE_TYPE_ROBJ,NODE_TYPE_BUFFER,NODE_TYPE_LONGLONG */
+    int8_t arena;/* allocated from a value_item_arena, never zfree it */
     uint32_t size;
     union _obj {
         void* obj;
@@ -236,15 +265,77 @@ typedef struct value_item_node {
 } value_item_node;
 
 
+/* Reply modes, see redisClient->reply_mode */
+#define REDIS_REPLY_LIST    0   /* linked value_item_node */
+#define REDIS_REPLY_FLAT    1   /* contiguous value_item_flat */
+
+/* Flat reply: one array of records plus an inline byte area. Small strings
+ * and ziplist/zipmap buffers are copied in (type BUFFER, u.offset into
+ * bytes), large strings are referenced (type ROBJ, the record owns one
+ * reference), numbers are stored in the record itself. */
+typedef struct value_item_record {
+    int8_t type;    /* NODE_TYPE_* */
+    int8_t inlined; /* payload is at bytes+u.offset */
+    uint32_t size;
+    union {
+        size_t offset;
+        void* obj;
+        double dnum;
+        long long llnum;
+    } u;
+} value_item_record;
+
+typedef struct value_item_flat {
+    value_item_record* records;
+    uint32_t first; /* records before this one were popped */
+    uint32_t count;
+    uint32_t cap;
+    char* bytes;
+    size_t used;
+    size_t size;
+    int cached;     /* owned by a client and reused by its next reply */
+    int busy;
+    int dbnum;      /* namespace charged for records and bytes */
+} value_item_flat;
+
+#define valueItemRecordPtr(_flat,_rec) \
+    ((_rec)->inlined ? (void*)((_flat)->bytes+(_rec)->u.offset) : (_rec)->u.obj)
+
 typedef struct value_item_list {
     struct value_item_node* head;
     struct value_item_node* tail;
     int len;
+    struct value_item_arena* arena; /* NULL if list and nodes are zmalloc'ed */
+    struct value_item_flat* flat;   /* not NULL in REDIS_REPLY_FLAT mode */
+    struct redisObject* pin;        /* container BUFFER nodes point into */
+    int pin_dbnum;
+    struct redisDb* db;             /* db whose replies count it, or NULL */
 } value_item_list;
 
+/* Per client bump allocator used to build replies. The list header and all
+ * of its nodes are carved from a chain of blocks, so a reply costs a few
+ * allocations instead of one per element. The arena is rewound in O(1)
+ * once every list allocated from it has been freed. */
+typedef struct value_item_arena_block {
+    struct value_item_arena_block* next;
+    size_t size;
+    size_t used;
+    long dbnum;     /* namespace charged for the block, see zmalloc.c */
+    char buf[];
+} value_item_arena_block;
+
+typedef struct value_item_arena {
+    struct value_item_arena_block* head;
+    struct value_item_arena_block* cur;
+    size_t total;   /* bytes held by all the blocks */
+    int lists;      /* lists allocated from the arena and not freed yet */
+} value_item_arena;
+
 typedef struct value_item_iterator {
     struct value_item_node* next;
     int now;
+    struct value_item_flat* flat;   /* flat replies are walked by index */
+    struct value_item_node node;    /* and handed out through this node */
 } value_item_iterator;
 
 /* return to push command*/
@@ -258,6 +349,11 @@ typedef struct push_return_value {
 /* The actual Redis Object */
 #define REDIS_LRU_CLOCK_MAX ((1<<21)-1) /* Max value of obj->lru */
 #define REDIS_LRU_CLOCK_RESOLUTION 10 /* LRU clock resolution in seconds */
+/* With an LFU maxmemory policy the lru field holds instead the last decrement
+ * time in minutes (16 bits) and a logarithmic access counter (8 bits). */
+#define REDIS_LFU_INIT_VAL 5    /* counter of new keys, so they survive a bit */
+#define REDIS_LFU_LOG_FACTOR 10 /* ~1M hits to saturate the counter */
+#define REDIS_LFU_DECAY_TIME 1  /* idle minutes per counter decrement */
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
@@ -283,6 +379,13 @@ typedef struct redisObject {
     removeXExpire(c->db,c->argv[1]); \
 }
 
+/* Eviction candidate kept across samplings, see evictionPoolPopulate() */
+#define REDIS_EVICTION_POOL_SIZE 16
+typedef struct evictionPoolEntry {
+    unsigned long idle;     /* object idle time when sampled */
+    sds key;                /* private copy of the key name */
+} evictionPoolEntry;
+
 typedef struct redisDb {
 #ifdef __cplusplus
     struct dict *dict;
@@ -291,7 +394,12 @@ typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
     dict *expires;              /* Timeout of keys with a timeout set */
 #endif
+    /* The values of db->expires are twNode, linked in expire_wheel by
+     * expire time (created with the first expire) */
+    timeWheel *expire_wheel;
     int id;
+    struct redisServer *server;
+    int active_idx;             /* in server->active_db, -1 when inactive */
 
     long long stat_evictedkeys;     /* number of evicted keys (maxmemory) */
     long long stat_expiredkeys;     /* number of expired keys */
@@ -305,6 +413,19 @@ typedef struct redisDb {
     int maxmemory_samples;
     uint16_t logiclock;
     size_t need_remove_key;
+    /* Incremental sweep of the keys invalidated by logiclock, see
+     * sweepStaleKeys() */
+    int sweep_running;
+    unsigned long sweep_cursor;         /* dictScan() cursor */
+    long long stat_sweep_scanned;       /* keys scanned by the current pass */
+    long long stat_sweep_reclaimed;     /* stale keys deleted by it */
+    long expire_effort;         /* keys expired per cron visit, adapted */
+    int maxmemory_policy;       /* REDIS_MAXMEMORY_{VOLATILE,ALLKEYS}_{LRU,LFU} */
+    /* LRU eviction candidates among volatile keys ([0]) and all keys ([1]),
+     * allocated on first eviction */
+    evictionPoolEntry *eviction_pool[2];
+    int eviction_pool_lfu;      /* pool entries are ranked by LFU */
+    int replies;                /* live replies of commands on this db */
 } redisDb;
 
 /* With multiplexing we need to take per-clinet state.
@@ -328,6 +449,9 @@ typedef struct redisClient {
     int returncode; //return code for example REDIS_OK;
     void* return_value; //return value by list
     ret_val retvalue;  //integer or double value
+    value_item_arena* reply_arena; //nodes of return_value are carved from here
+    int reply_mode; //REDIS_REPLY_LIST or REDIS_REPLY_FLAT
+    value_item_flat* reply_flat; //records reused by flat replies
 
     struct redisServer *server;
 } redisClient;
@@ -340,6 +464,9 @@ struct saveparam {
 struct sharedObjectsStruct {
     robj *integers[REDIS_SHARED_INTEGERS];
     unsigned lruclock:22;        /* clock incrementing every minute, for LRU */
+    unsigned lfuclock:16;        /* minutes, for the LFU decrement time */
+    long long mstime;            /* cached UNIX time in milliseconds */
+    long long mstime_offset;     /* UNIX minus monotonic time, see updateCachedTime() */
 };
 
 struct redisLogConfig {
@@ -354,9 +481,16 @@ struct redisLogConfig {
 struct redisServer {
     pthread_t mainthread;
     redisDb *db;
+    /* Only the dbs holding keys have a keyspace, the others share these
+     * two empty dicts, see activateDb() */
+    int *active_db;             /* ids of the dbs with a keyspace */
+    int active_dbnum;
+    dict *emptydict;
+    dict *emptyexpires;
     long long dirty;            /* changes to DB from the last save */
     list *clients;
     int cronloops;              /* number of times the cron function run */
+    int cron_db;                /* active_db index the next cron starts from */
     /* Fields used only for stats */
     time_t stat_starttime;          /* server start time */
     long long stat_numcommands;     /* number of processed commands */
@@ -365,6 +499,8 @@ struct redisServer {
     int maxidletime;
     int dbnum;
     int activerehashing;
+    long long cron_budget;      /* us of keyspace work per cron, 0 disables */
+    size_t lazyfree_threshold;      /* elements, 0 disables the lazy free */
     /* Limits */
     unsigned long long maxmemory;
     int maxmemory_policy;
@@ -374,6 +510,7 @@ struct redisServer {
     size_t hash_max_zipmap_value;
     size_t list_max_ziplist_entries;
     size_t list_max_ziplist_value;
+    int list_compress_depth;
     size_t set_max_intset_entries;
 
     int list_max_size;
@@ -444,6 +581,7 @@ typedef struct {
     unsigned char direction; /* Iteration direction */
     unsigned char *zi;
     listNode *ln;
+    quicklistIter qi;
 } listTypeIterator;
 
 /* Structure for an entry while iterating over a list. */
@@ -451,6 +589,7 @@ typedef struct {
     listTypeIterator *li;
     unsigned char *zi;  /* Entry in ziplist */
     listNode *ln;       /* Entry in linked list */
+    quicklistEntry qe;  /* Entry in quicklist */
 } listTypeEntry;
 
 /* Structure to hold set iteration abstraction. */
@@ -489,6 +628,8 @@ extern struct redisLogConfig logConfig;
 extern struct redisServer server;
 #endif
 extern struct sharedObjectsStruct shared;
+extern dictType dbDictType;
+extern dictType keyptrDictType;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
@@ -503,7 +644,16 @@ value_item_iterator* createValueItemIterator(value_item_list* list);
 value_item_node* nextValueItemNode(value_item_iterator** it);
 void freeValueItemIterator(value_item_iterator** it);
 value_item_list* createValueItemList();
+value_item_list* createClientValueItemList(redisClient* c, uint32_t hint);
 void freeValueItemList(value_item_list* list);
+value_item_arena* createValueItemArena();
+void freeValueItemArena(value_item_arena* arena);
+void resetValueItemArena(value_item_arena* arena);
+void* allocValueItemArena(value_item_arena* arena, size_t size);
+int reserveValueItemArena(value_item_arena* arena, size_t size);
+void freeValueItemFlat(value_item_flat* flat);
+value_item_flat* getValueItemFlat(value_item_list* list);
+void pinValueItemList(value_item_list* list, struct redisObject* o);
 value_item_node* createValueItemNode(robj* obj);
 value_item_node* createGenericValueItemNode(void* obj,uint32_t size,int type);
 value_item_node* createDoubleValueItemNode(double score);
@@ -511,12 +661,16 @@ value_item_node* createLongLongValueItemNode(long long llnum);
 void freeValueItemNode(value_item_node* node);
 int rpushValueItemNode(value_item_list* list, robj* obj);
 int rpushGenericValueItemNode(value_item_list* list,void* obj,uint32_t size,int type);
+int rpushBufferCopyValueItemNode(value_item_list* list,void* buf,uint32_t size);
 int rpushDoubleValueItemNode(value_item_list* list, double score);
 int rpushLongLongValueItemNode(value_item_list* list, long long llnum);
 int lpushValueItemNode(value_item_list* list, robj* obj);
 int lpushGenericValueItemNode(value_item_list* list,void* obj,uint32_t size,int type);
 int lpushDoubleValueItemNode(value_item_list* list, double score);
 void removeValueItemNode(value_item_node* node);
+/* The popped node is the caller's, to free with freeValueItemNode(). A
+ * BUFFER payload points into the reply or the value it pins, and is only
+ * valid until the list is freed. */
 value_item_node* lpopValueItemNode(value_item_list* list);
 value_item_node* rpopValueItemNode(value_item_list* list);
 int getValueItemNodeType(value_item_node* node);
@@ -540,6 +694,8 @@ void getClientsMaxBuffers(unsigned long *longest_output_list,
 void listTypeTryConversion(redisClient *c, robj *subject, robj *value);
 void listTypePush(redisClient *c, robj *subject, robj *value, int where);
 robj *listTypePop(robj *subject, int where);
+unsigned long listTypePopRange(robj *subject, int where, unsigned long count,
+                               value_item_list *vlist);
 unsigned long listTypeLength(robj *subject);
 listTypeIterator *listTypeInitIterator(robj *subject, int index, unsigned char direction);
 void listTypeReleaseIterator(listTypeIterator *li);
@@ -548,7 +704,7 @@ robj *listTypeGet(listTypeEntry *entry);
 void listTypeInsert(listTypeEntry *entry, robj *value, int where);
 int listTypeEqual(listTypeEntry *entry, robj *o);
 void listTypeDelete(listTypeEntry *entry);
-void listTypeConvert(robj *subject, int enc);
+void listTypeConvert(redisClient *c, robj *subject, int enc);
 void popGenericCommand(redisClient *c, int where);
 
 /* Redis object implementation */
@@ -563,6 +719,7 @@ void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(char *ptr, size_t len, uint16_t logiclock, uint16_t version);
+robj *createEmbeddedStringObject(char *ptr, size_t len, uint16_t logiclock, uint16_t version);
 robj *dupStringObject(robj *o);
 robj *tryObjectEncoding(robj *o);
 robj *getDecodedObject(robj *o);
@@ -570,6 +727,7 @@ size_t stringObjectLen(robj *o);
 robj *createStringObjectFromLongLong(long long value);
 robj *createListObject();
 robj *createZiplistObject();
+robj *createQuicklistObject(int fill, int compress);
 robj *createSetObject();
 robj *createIntsetObject();
 robj *createHashObject();
@@ -582,6 +740,9 @@ char *strEncoding(int encoding);
 int compareStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
 unsigned long estimateObjectIdleTime(robj *o);
+unsigned long LFUDecrAndReturn(robj *o);
+void updateObjectLFU(robj *o);
+void initObjectLFU(robj *o);
 
 /* Synchronous I/O with timeout */
 int syncWrite(int fd, char *ptr, ssize_t size, int timeout);
@@ -600,6 +761,7 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
 /* Core functions */
 void freeMemoryIfNeeded(struct redisServer *server);
 void freeDBMemoryIfNeeded(struct redisDb *db);
+void evictionPoolRelease(redisDb *db);
 int processCommand(redisClient *c);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(redisServer *server, sds name);
@@ -647,6 +809,12 @@ int hashTypeCurrent(hashTypeIterator *hi, int what, robj **objval, unsigned char
 robj *hashTypeCurrentObject(hashTypeIterator *hi, int what);
 robj *hashTypeLookupWriteOrCreate(redisClient *c, robj *key);
 
+/* lazyfree.c -- Background freeing of big values */
+void lazyfreeObject(redisServer *server, robj *o);
+size_t lazyfreePendingObjects(void);
+void lazyfreeDrain(void);
+void lazyfreeStop(void);
+
 /* Utility functions */
 int stringmatchlen(const char *pattern, int patternLen,
         const char *string, int stringLen, int nocase);
@@ -657,6 +825,10 @@ int isStringRepresentableAsLong(sds s, long *longval);
 int isStringRepresentableAsLongLong(sds s, long long *longval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 long long ustime(void);
+long long mstime(void);
+long long monotime(void);
+void updateCachedTime(void);
+void refreshCachedTime(void);
 
 /* Configuration */
 void appendServerSaveParams(time_t seconds, int changes);
@@ -674,11 +846,15 @@ int removeXExpire(redisDb *db, robj *key);
 void propagateExpire(redisDb *db, robj *key);
 int expireIfNeeded(redisDb *db, robj *key);
 time_t getExpire(redisDb *db, robj *key);
-void setExpire(redisDb *db, robj *key, time_t when);
-void setXExpire(redisDb *db, robj *key, time_t when);
+long long getExpireMs(redisDb *db, robj *key);
+int setExpireMs(redisDb *db, robj *key, long long when);
+int setExpire(redisDb *db, robj *key, time_t when);
+int setXExpire(redisDb *db, robj *key, time_t when);
 robj *lookupKeyWithVersion(redisDb *db, robj *key, uint16_t *version);
 robj *lookupKeyReadWithVersion(redisDb *db, robj *key, uint16_t *version);
+void lookupKeysReadWithVersion(redisDb *db, robj **keys, int count, robj **vals, uint16_t *versions);
 robj *lookupKeyWriteWithVersion(redisDb *db, robj *key, uint16_t *version);
+robj *lookupKeyWriteInPlaceWithVersion(redisDb *db, robj *key, int type, uint16_t *version);
 robj *lookupKeyReadOrReplyWithVersion(redisClient *c, robj *key, robj *reply, uint16_t *version);
 robj *lookupKeyReadOrStatusReplyWithVersion(redisClient *c, robj *key, robj *reply, uint16_t *version);
 robj *lookupKeyWriteOrReplyWithVersion(redisClient *c, robj *key, robj *reply, uint16_t *version);
@@ -690,6 +866,10 @@ int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbDelete(redisDb *db, robj *key);
 long long emptyDb();
+int enableDbArena(redisServer *server, int id);
+long long dropDb(redisServer *server, int id);
+void activateDb(redisDb *db);
+int releaseIdleDb(redisDb *db);
 int selectDb(redisClient *c, int id);
 
 /* Git SHA1 */
@@ -697,6 +877,7 @@ char *redisGitSHA1(void);
 char *redisGitDirty(void);
 
 int setDBMaxmemory(redisServer *server, int db, uint64_t maxmem);
+int setDBMaxmemoryPolicy(redisServer *server, int db, int policy);
 
 /* Commands prototypes */
 void setCommand(redisClient *c);
@@ -704,6 +885,7 @@ void setnxCommand(redisClient *c);
 void setnxexCommand(redisClient *c);
 void setexCommand(redisClient *c);
 void getCommand(redisClient *c);
+void mgetCommand(redisClient *c);
 void delCommand(redisClient *c);
 void existsCommand(redisClient *c);
 void incrCommand(redisClient *c);
@@ -740,6 +922,8 @@ void monitorCommand(redisClient *c);
 void expireCommand(redisClient *c);
 void getsetCommand(redisClient *c);
 void ttlCommand(redisClient *c);
+void pexpireCommand(redisClient *c);
+void pttlCommand(redisClient *c);
 void persistCommand(redisClient *c);
 void slaveofCommand(redisClient *c);
 void zaddCommand(redisClient *c);
@@ -23,7 +23,7 @@ void hashTypeTryConversion(struct redisClient* c, robj *subject, robj **argv, in
     if (subject->encoding != REDIS_ENCODING_ZIPMAP) return;
 
     for (i = start; i <= end; i++) {
-        if (argv[i]->encoding == REDIS_ENCODING_RAW &&
+        if (sdsEncodedObject(argv[i]) &&
             sdslen(argv[i]->ptr) > c->server->hash_max_zipmap_value)
         {
             convertToRealHash(subject);
@@ -241,7 +241,7 @@ robj *hashTypeCurrentObject(hashTypeIterator *hi, int what) {
 }
 
 robj *hashTypeLookupWriteOrCreate(redisClient *c, robj *key) {
-    robj *o = lookupKeyWriteWithVersion(c->db,key,&(c->version));
+    robj *o = lookupKeyWriteInPlaceWithVersion(c->db,key,REDIS_HASH,&(c->version));
     if (o == NULL) {
         sdsversion_change(key->ptr, 0);
         if(c->version_care) {
@@ -446,18 +446,19 @@ void hgetCommand(redisClient *c) {
     }
 
     if ((encoding = hashTypeGet(o,c->argv[2],&value,&v,&vlen)) != -1) {
-        value_item_list* vlist = createValueItemList();
+        value_item_list* vlist = createClientValueItemList(c,1);
         if(vlist == NULL) {
             c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
             return;
         }
+        if (encoding == REDIS_ENCODING_ZIPMAP) pinValueItemList(vlist,o);
 
         if (encoding == REDIS_ENCODING_HT) {
             if (value->encoding == REDIS_ENCODING_INT) {
                 rpushLongLongValueItemNode(vlist, (long)value->ptr);
             } else {
-                rpushValueItemNode(vlist,value);
                 incrRefCount(value);
+                rpushValueItemNode(vlist,value);
             }
         } else {
             rpushGenericValueItemNode(vlist,v,vlen,NODE_TYPE_BUFFER);
@@ -489,11 +490,12 @@ void hmgetCommand(redisClient *c) {
      * done because objects that cannot be found are considered to be
      * an empty hash. The reply should then be a series of NULLs. */
     //addReplyMultiBulkLen(c,c->argc-2);
-    value_item_list* vlist = createValueItemList();
+    value_item_list* vlist = createClientValueItemList(c,c->argc-2);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
     }
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) pinValueItemList(vlist,o);
     for (i = 2; i < c->argc; i++) {
         if (o != NULL &&
             (encoding = hashTypeGet(o,c->argv[i],&value,&v,&vlen)) != -1) {
@@ -501,8 +503,8 @@ void hmgetCommand(redisClient *c) {
                 if (value->encoding == REDIS_ENCODING_INT) {
                     rpushLongLongValueItemNode(vlist, (long)value->ptr);
                 } else {
-                    rpushValueItemNode(vlist,value);
                     incrRefCount(value);
+                    rpushValueItemNode(vlist,value);
                 }
             } else {
                 rpushGenericValueItemNode(vlist,v,vlen,NODE_TYPE_BUFFER);
@@ -516,7 +518,7 @@ void hmgetCommand(redisClient *c) {
 }
 
 void hdelCommand(redisClient *c) {
-    robj *o = lookupKeyWriteWithVersion(c->db,c->argv[1],&(c->version));
+    robj *o = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_HASH,&(c->version));
     if (o == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
@@ -588,11 +590,15 @@ void genericHgetallCommand(redisClient *c, int flags) {
         return;
     }
 
-    value_item_list* vlist = createValueItemList();
+    count = hashTypeLength(o);
+    if ((flags & REDIS_HASH_KEY) && (flags & REDIS_HASH_VALUE)) count *= 2;
+    value_item_list* vlist = createClientValueItemList(c,count);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
     }
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) pinValueItemList(vlist,o);
+    count = 0;
     hi = hashTypeInitIterator(o);
     while (hashTypeNext(hi) != REDIS_ERR) {
         robj *obj;
@@ -606,8 +612,8 @@ void genericHgetallCommand(redisClient *c, int flags) {
                 if (obj->encoding == REDIS_ENCODING_INT) {
                     rpushLongLongValueItemNode(vlist, (long)obj->ptr);
                 } else {
-                    rpushValueItemNode(vlist,obj);
                     incrRefCount(obj);
+                    rpushValueItemNode(vlist,obj);
                 }
             } else {
                 rpushGenericValueItemNode(vlist,v,vlen,NODE_TYPE_BUFFER);
@@ -620,8 +626,8 @@ void genericHgetallCommand(redisClient *c, int flags) {
                 if (obj->encoding == REDIS_ENCODING_INT) {
                     rpushLongLongValueItemNode(vlist, (long)obj->ptr);
                 } else {
-                    rpushValueItemNode(vlist,obj);
                     incrRefCount(obj);
+                    rpushValueItemNode(vlist,obj);
                 }
             } else {
                 rpushGenericValueItemNode(vlist,v,vlen,NODE_TYPE_BUFFER);
@@ -11,14 +11,21 @@
     }                                                   \
 } while(0)
 
+/* Object holding the value of a quicklist entry */
+static robj *createObjectFromQuicklistEntry(quicklistEntry *qe) {
+    if (qe->vstr)
+        return createStringObject((char*)qe->vstr,qe->vlen,0,0);
+    return createStringObjectFromLongLong(qe->vlong);
+}
+
 /* Check the argument length to see if it requires us to convert the ziplist
- * to a real list. Only check raw-encoded objects because integer encoded
+ * to a quicklist. Only check raw-encoded objects because integer encoded
  * objects are never too long. */
 void listTypeTryConversion(redisClient *c, robj *subject, robj *value) {
     if (subject->encoding != REDIS_ENCODING_ZIPLIST) return;
-    if (value->encoding == REDIS_ENCODING_RAW &&
+    if (sdsEncodedObject(value) &&
         sdslen(value->ptr) > c->server->list_max_ziplist_value)
-            listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+            listTypeConvert(c,subject,REDIS_ENCODING_QUICKLIST);
 }
 
 void listTypePush(redisClient *c, robj *subject, robj *value, int where) {
@@ -26,13 +33,18 @@ void listTypePush(redisClient *c, robj *subject, robj *value, int where) {
     listTypeTryConversion(c, subject,value);
     if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
         ziplistLen(subject->ptr) >= c->server->list_max_ziplist_entries)
-            listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+            listTypeConvert(c,subject,REDIS_ENCODING_QUICKLIST);
 
     if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
         int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
         value = getDecodedObject(value);
         subject->ptr = ziplistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
         decrRefCount(value);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+        value = getDecodedObject(value);
+        quicklistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
+        decrRefCount(value);
     } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
         if (where == REDIS_HEAD) {
             listAddNodeHead(subject->ptr,value);
@@ -63,6 +75,14 @@ robj *listTypePop(robj *subject, int where) {
             /* We only need to delete an element when it exists */
             subject->ptr = ziplistDelete(subject->ptr,&p);
         }
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistEntry qe;
+        long index = (where == REDIS_HEAD) ? 0 : -1;
+
+        if (quicklistIndex(subject->ptr,index,&qe)) {
+            value = createObjectFromQuicklistEntry(&qe);
+            quicklistDelRange(subject->ptr,index,1);
+        }
     } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
         list *list = subject->ptr;
         listNode *ln;
@@ -82,9 +102,73 @@ robj *listTypePop(robj *subject, int where) {
     return value;
 }
 
+static void pushPoppedValue(void *privdata, void *value) {
+    rpushValueItemNode(privdata,value);
+}
+
+/* Pop up to 'count' elements from the head or the tail, in the order
+ * repeated listTypePop() calls would return them, and push them to 'vlist'.
+ * The elements are removed in one go once collected. Ziplist entries are
+ * copied to the reply as they are, no object is created for them. Returns
+ * the number of elements popped. */
+unsigned long listTypePopRange(robj *subject, int where, unsigned long count,
+                               value_item_list *vlist) {
+    unsigned long len = listTypeLength(subject), j;
+
+    if (count > len) count = len;
+    if (count == 0) return 0;
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p;
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+
+        p = ziplistIndex(subject->ptr,(where == REDIS_HEAD) ? 0 : -1);
+        for (j = 0; j < count; j++) {
+            ziplistGet(p,&vstr,&vlen,&vlong);
+            if (vstr) {
+                rpushBufferCopyValueItemNode(vlist,vstr,vlen);
+            } else {
+                rpushLongLongValueItemNode(vlist,vlong);
+            }
+            p = (where == REDIS_HEAD) ? ziplistNext(subject->ptr,p) :
+                                        ziplistPrev(subject->ptr,p);
+        }
+        subject->ptr = ziplistDeleteRange(subject->ptr,
+            (where == REDIS_HEAD) ? 0 : -(long)count,count);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter qi;
+        quicklistEntry qe;
+
+        if (where == REDIS_HEAD)
+            quicklistInitIterator(subject->ptr,&qi,0,QUICKLIST_TAIL);
+        else
+            quicklistInitIterator(subject->ptr,&qi,-1,QUICKLIST_HEAD);
+        for (j = 0; j < count && quicklistNext(&qi,&qe); j++) {
+            if (qe.vstr) {
+                rpushBufferCopyValueItemNode(vlist,qe.vstr,qe.vlen);
+            } else {
+                rpushLongLongValueItemNode(vlist,qe.vlong);
+            }
+        }
+        quicklistDelRange(subject->ptr,
+            (where == REDIS_HEAD) ? 0 : -(long)count,count);
+    } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        /* The reply takes over the references of the list */
+        listDelRange(subject->ptr,
+            (where == REDIS_HEAD) ? AL_START_HEAD : AL_START_TAIL,count,
+            pushPoppedValue,vlist);
+    } else {
+        redisPanic("Unknown list encoding");
+    }
+    return count;
+}
+
 unsigned long listTypeLength(robj *subject) {
     if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
         return ziplistLen(subject->ptr);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        return ((quicklist*)subject->ptr)->count;
     } else if (subject->encoding == REDIS_ENCODING_LINKEDLIST) {
         return listLength((list*)subject->ptr);
     } else {
@@ -100,6 +184,9 @@ listTypeIterator *listTypeInitIterator(robj *subject, int index, unsigned char d
     li->direction = direction;
     if (li->encoding == REDIS_ENCODING_ZIPLIST) {
         li->zi = ziplistIndex(subject->ptr,index);
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistInitIterator(subject->ptr,&li->qi,index,
+            direction == REDIS_TAIL ? QUICKLIST_TAIL : QUICKLIST_HEAD);
     } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
         li->ln = listIndex(subject->ptr,index);
     } else {
@@ -130,6 +217,8 @@ int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
                 li->zi = ziplistPrev(li->subject->ptr,li->zi);
             return 1;
         }
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistNext(&li->qi,&entry->qe);
     } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
         entry->ln = li->ln;
         if (entry->ln != NULL) {
@@ -161,6 +250,8 @@ robj *listTypeGet(listTypeEntry *entry) {
                 value = createStringObjectFromLongLong(vlong);
             }
         }
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        value = createObjectFromQuicklistEntry(&entry->qe);
     } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
         redisAssert(entry->ln != NULL);
         value = listNodeValue(entry->ln);
@@ -189,6 +280,11 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
             subject->ptr = ziplistInsert(subject->ptr,entry->zi,value->ptr,sdslen(value->ptr));
         }
         decrRefCount(value);
+    } else if (entry->li->encoding == REDIS_ENCODING_QUICKLIST) {
+        value = getDecodedObject(value);
+        quicklistInsert(subject->ptr,&entry->qe,value->ptr,sdslen(value->ptr),
+                        where == REDIS_TAIL);
+        decrRefCount(value);
     } else if (entry->li->encoding == REDIS_ENCODING_LINKEDLIST) {
         if (where == REDIS_TAIL) {
             listInsertNode(subject->ptr,entry->ln,value,AL_START_TAIL);
@@ -205,8 +301,11 @@ void listTypeInsert(listTypeEntry *entry, robj *value, int where) {
 int listTypeEqual(listTypeEntry *entry, robj *o) {
     listTypeIterator *li = entry->li;
     if (li->encoding == REDIS_ENCODING_ZIPLIST) {
-        redisAssert(o->encoding == REDIS_ENCODING_RAW);
+        redisAssert(sdsEncodedObject(o));
         return ziplistCompare(entry->zi,o->ptr,sdslen(o->ptr));
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        redisAssert(sdsEncodedObject(o));
+        return ziplistCompare(entry->qe.zi,o->ptr,sdslen(o->ptr));
     } else if (li->encoding == REDIS_ENCODING_LINKEDLIST) {
         return equalStringObjects(o,listNodeValue(entry->ln));
     } else {
@@ -226,6 +325,8 @@ void listTypeDelete(listTypeEntry *entry) {
             li->zi = p;
         else
             li->zi = ziplistPrev(li->subject->ptr,p);
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDelEntry(&li->qi,&entry->qe);
     } else if (entry->li->encoding == REDIS_ENCODING_LINKEDLIST) {
         listNode *next;
         if (li->direction == REDIS_TAIL)
@@ -239,7 +340,7 @@ void listTypeDelete(listTypeEntry *entry) {
     }
 }
 
-void listTypeConvert(robj *subject, int enc) {
+void listTypeConvert(redisClient *c, robj *subject, int enc) {
     listTypeIterator *li;
     listTypeEntry entry;
     redisAssert(subject->type == REDIS_LIST);
@@ -256,6 +357,27 @@ void listTypeConvert(robj *subject, int enc) {
         subject->encoding = REDIS_ENCODING_LINKEDLIST;
         zfree(subject->ptr);
         subject->ptr = l;
+    } else if (enc == REDIS_ENCODING_QUICKLIST) {
+        quicklist *ql = quicklistCreate(c->server->list_max_ziplist_entries,
+                                        c->server->list_compress_depth);
+        unsigned char *p = ziplistIndex(subject->ptr,0);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vlong;
+        char buf[32];
+
+        redisAssert(subject->encoding == REDIS_ENCODING_ZIPLIST);
+        while (p && ziplistGet(p,&vstr,&vlen,&vlong)) {
+            if (vstr == NULL) {
+                vlen = ll2string(buf,sizeof(buf),vlong);
+                vstr = (unsigned char*)buf;
+            }
+            quicklistPush(ql,vstr,vlen,QUICKLIST_TAIL);
+            p = ziplistNext(subject->ptr,p);
+        }
+        subject->encoding = REDIS_ENCODING_QUICKLIST;
+        zfree(subject->ptr);
+        subject->ptr = ql;
     } else {
         redisPanic("Unsupported list conversion");
     }
@@ -269,7 +391,7 @@ void pushnGenericCommand(redisClient *c, int where) {
     /* return_value must be null,otherwise it have memory leak */
     c->returncode = REDIS_ERR;
 
-    robj *lobj = lookupKeyWriteWithVersion(c->db, c->argv[1], &c->version);
+    robj *lobj = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&c->version);
 
     robj* key = c->argv[1];
     if(lobj != NULL) {
@@ -346,7 +468,7 @@ void pushxnGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
     listTypeIterator *iter;
     listTypeEntry entry;
     int inserted = 0;
-    if ((subject = lookupKeyReadWithVersion(c->db,c->argv[1],&c->version)) == NULL) {
+    if ((subject = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&c->version)) == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
     }
@@ -375,7 +497,7 @@ void pushxnGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
     if(refval != NULL) {
         /* Note: we expect refval to be string-encoded because it is *not* the
          * last argument of the multi-bulk LINSERT. */
-        redisAssert(refval->encoding == REDIS_ENCODING_RAW);
+        redisAssert(sdsEncodedObject(refval));
 
         /* We're not sure if this value can be inserted yet, but we cannot
          * convert the list inside the iterator. We don't want to loop over
@@ -399,7 +521,7 @@ void pushxnGenericCommand(redisClient *c, robj *refval, robj *val, int where) {
             /* Check if the length exceeds the ziplist length threshold. */
             if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
                 ziplistLen(subject->ptr) > c->server->list_max_ziplist_entries)
-                    listTypeConvert(subject,REDIS_ENCODING_LINKEDLIST);
+                    listTypeConvert(c,subject,REDIS_ENCODING_QUICKLIST);
             c->server->dirty++;
         } else {
             /* Notify client of a failed insert */
@@ -499,7 +621,7 @@ void lindexCommand(redisClient *c) {
     int index = atoi(c->argv[2]->ptr);
     robj *value = NULL;
 
-    value_item_list* vlist = createValueItemList();
+    value_item_list* vlist = createClientValueItemList(c,1);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
@@ -525,6 +647,18 @@ void lindexCommand(redisClient *c) {
             vlist = NULL;
             c->returncode = REDIS_ERR_OUT_OF_RANGE;
         }
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistEntry qe;
+        if (quicklistIndex(o->ptr,index,&qe)) {
+            value = createObjectFromQuicklistEntry(&qe);
+            rpushValueItemNode(vlist,value);
+            c->return_value = (void*)vlist;
+            c->returncode = REDIS_OK;
+        } else {
+            freeValueItemList(vlist);
+            vlist = NULL;
+            c->returncode = REDIS_ERR_OUT_OF_RANGE;
+        }
     } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
         listNode *ln = listIndex(o->ptr,index);
         if (ln != NULL) {
@@ -544,7 +678,7 @@ void lindexCommand(redisClient *c) {
 }
 
 void lsetCommand(redisClient *c) {
-    robj *o = lookupKeyWriteWithVersion(c->db,c->argv[1],&(c->version));
+    robj *o = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&(c->version));
     if (o == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
@@ -589,6 +723,18 @@ void lsetCommand(redisClient *c) {
             dbUpdateKey(c->db, key);
             c->server->dirty++;
         }
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistEntry qe;
+        if (!quicklistIndex(o->ptr,index,&qe)) {
+            c->returncode = REDIS_ERR_OUT_OF_RANGE;
+        } else {
+            value = getDecodedObject(value);
+            quicklistReplaceEntry(o->ptr,&qe,value->ptr,sdslen(value->ptr));
+            decrRefCount(value);
+            c->returncode = REDIS_OK;
+            dbUpdateKey(c->db, key);
+            c->server->dirty++;
+        }
     } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
         listNode *ln = listIndex(o->ptr,index);
         if (ln == NULL) {
@@ -609,7 +755,7 @@ void lsetCommand(redisClient *c) {
 //tair's new pop, support mutli values
 void popnGenericCommand(redisClient *c, int where) {
     c->returncode = REDIS_ERR;
-    robj *o = lookupKeyWriteWithVersion(c->db,c->argv[1],&(c->version));
+    robj *o = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&(c->version));
     if(o == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
@@ -644,27 +790,16 @@ void popnGenericCommand(redisClient *c, int where) {
         sdsversion_add(key->ptr, 1);
     }
 
-    value_item_list* vlist = createValueItemList();
+    unsigned long llen = listTypeLength(o);
+    value_item_list* vlist = createClientValueItemList(c,
+            (unsigned long)count < llen ? (unsigned long)count : llen);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
     }
 
-    int now = 0;
-    for(; now < count; now++) {
-        robj *value = listTypePop(o, where);
-        if(value == NULL) {
-            break;
-        } else {
-           rpushValueItemNode(vlist, value);
-           if(listTypeLength(o) == 0) {
-               dbDelete(c->db,c->argv[1]);
-               c->server->dirty++;
-               break;
-           }
-           c->server->dirty++;
-        }
-    }
+    c->server->dirty += listTypePopRange(o,where,count,vlist);
+    if (listTypeLength(o) == 0) dbDelete(c->db,c->argv[1]);
 
     dbUpdateKey(c->db,key);
     c->version++;
@@ -718,7 +853,7 @@ void lrangeCommand(redisClient *c) {
     rangelen = (end-start)+1;
 
     /* Return the result in form of a multi-bulk reply */
-    value_item_list* vlist = createValueItemList();
+    value_item_list* vlist = createClientValueItemList(c,rangelen);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
@@ -730,6 +865,7 @@ void lrangeCommand(redisClient *c) {
         unsigned int vlen;
         long long vlong;//long long at 64-bit as void*
 
+        pinValueItemList(vlist,o);
         while(rangelen--) {
             ziplistGet(p,&vstr,&vlen,&vlong);
             if (vstr) {
@@ -739,6 +875,19 @@ void lrangeCommand(redisClient *c) {
             }
             p = ziplistNext(o->ptr,p);
         }
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter qi;
+        quicklistEntry qe;
+
+        pinValueItemList(vlist,o);
+        quicklistInitIterator(o->ptr,&qi,start,QUICKLIST_TAIL);
+        while(rangelen-- && quicklistNext(&qi,&qe)) {
+            if (qe.vstr) {
+                rpushGenericValueItemNode(vlist,(void*)qe.vstr,qe.vlen,NODE_TYPE_BUFFER);
+            } else {
+                rpushGenericValueItemNode(vlist,(void*)qe.vlong,0,NODE_TYPE_LONGLONG);
+            }
+        }
     } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
         listNode *ln = listIndex(o->ptr,start);
 
@@ -748,7 +897,7 @@ void lrangeCommand(redisClient *c) {
             ln = ln->next;
         }
     } else {
-        redisPanic("List encoding is not LINKEDLIST nor ZIPLIST!");
+        redisPanic("List encoding is not LINKEDLIST, ZIPLIST nor QUICKLIST!");
     }
     c->return_value = (void*)vlist;
     c->returncode = REDIS_OK;
@@ -759,12 +908,9 @@ void ltrimCommand(redisClient *c) {
     int start = atoi(c->argv[2]->ptr);
     int end = atoi(c->argv[3]->ptr);
     int llen;
-    int j, ltrim, rtrim;
-    list *list;
-    listNode *ln;
+    int ltrim, rtrim;
 
-    robj *o = lookupKeyWriteWithVersion(c->db,c->argv[1],
-            &(c->version));
+    robj *o = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&(c->version));
     if (o == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
@@ -814,16 +960,12 @@ void ltrimCommand(redisClient *c) {
     if (o->encoding == REDIS_ENCODING_ZIPLIST) {
         o->ptr = ziplistDeleteRange(o->ptr,0,ltrim);
         o->ptr = ziplistDeleteRange(o->ptr,-rtrim,rtrim);
+    } else if (o->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistDelRange(o->ptr,0,ltrim);
+        quicklistDelRange(o->ptr,-rtrim,rtrim);
     } else if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
-        list = o->ptr;
-        for (j = 0; j < ltrim; j++) {
-            ln = listFirst(list);
-            listDelNode(list,ln);
-        }
-        for (j = 0; j < rtrim; j++) {
-            ln = listLast(list);
-            listDelNode(list,ln);
-        }
+        listDelRange(o->ptr,AL_START_HEAD,ltrim,NULL,NULL);
+        listDelRange(o->ptr,AL_START_TAIL,rtrim,NULL,NULL);
     } else {
         redisPanic("Unknown list encoding");
     }
@@ -850,7 +992,7 @@ void lremCommand(redisClient *c) {
     long removed = 0;
     listTypeEntry entry;
 
-    subject = lookupKeyWriteWithVersion(c->db,c->argv[1],&(c->version));
+    subject = lookupKeyWriteInPlaceWithVersion(c->db,c->argv[1],REDIS_LIST,&(c->version));
     if (subject == NULL) {
         c->returncode = REDIS_OK_NOT_EXIST;
         return;
@@ -873,8 +1015,9 @@ void lremCommand(redisClient *c) {
     }
 
     /* Make sure obj is raw when we're dealing with a ziplist */
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        obj = getDecodedObject(obj);
+    int decoded = subject->encoding == REDIS_ENCODING_ZIPLIST ||
+                  subject->encoding == REDIS_ENCODING_QUICKLIST;
+    if (decoded) obj = getDecodedObject(obj);
 
     listTypeIterator *li;
     if (toremove < 0) {
@@ -895,8 +1038,7 @@ void lremCommand(redisClient *c) {
     listTypeReleaseIterator(li);
 
     /* Clean up raw encoded object */
-    if (subject->encoding == REDIS_ENCODING_ZIPLIST)
-        decrRefCount(obj);
+    if (decoded) decrRefCount(obj);
 
     if (listTypeLength(subject) == 0) dbDelete(c->db,c->argv[1]);
     c->retvalue.llnum = removed;
@@ -439,7 +439,7 @@ void spopCommand(redisClient *c) {
     //decrRefCount(ele);
     //decrRefCount(aux);
 
-    value_item_list *vlist = createValueItemList();
+    value_item_list *vlist = createClientValueItemList(c,1);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
@@ -503,7 +503,7 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
      * to the output list and save the pointer to later modify it with the
      * right length */
     if (!dstkey) {
-        vlist = createValueItemList();
+        vlist = createClientValueItemList(c,setTypeSize(sets[0]));
         if(vlist == NULL) {
             c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
             return;
@@ -562,8 +562,8 @@ void sinterGenericCommand(redisClient *c, robj **setkeys, unsigned long setnum,
                     if (eleobj->encoding == REDIS_ENCODING_INT) {
                         rpushLongLongValueItemNode(vlist, (long)eleobj->ptr);
                     } else {
-                        rpushValueItemNode(vlist,eleobj);
                         incrRefCount(eleobj);
+                        rpushValueItemNode(vlist,eleobj);
                     }
                 } else {
                     rpushLongLongValueItemNode(vlist,intobj);
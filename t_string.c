@@ -41,7 +41,10 @@ void setGenericCommand(redisClient *c, int nx, robj *key, robj *val, robj *expir
     retval = dbAdd(c->db,key,val);
     if (retval == REDIS_ERR) {
         if (!nx) {
-            dbSuperReplace(c->db,key,val);
+            if (dbSuperReplace(c->db,key,val) == -1) {
+                c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+                return;
+            }
             incrRefCount(val);
         } else {
             c->returncode = REDIS_OK_BUT_ALREADY_EXIST;
@@ -52,7 +55,10 @@ void setGenericCommand(redisClient *c, int nx, robj *key, robj *val, robj *expir
     }
     c->server->dirty++;
     if (expire) {
-        setExpire(c->db,key,seconds);
+        if (setExpire(c->db,key,seconds) != REDIS_OK) {
+            c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+            return;
+        }
     } else if(c->expiretime == 0) {
         removeXExpire(c->db, key);
     }
@@ -92,7 +98,7 @@ int getGenericCommand(redisClient *c) {
         c->returncode = REDIS_ERR_WRONG_TYPE_ERROR;
         return REDIS_ERR;
     } else {
-        value_item_list* vlist = createValueItemList();
+        value_item_list* vlist = createClientValueItemList(c,1);
         if(vlist == NULL) {
             c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
             return REDIS_ERR;
@@ -100,8 +106,8 @@ int getGenericCommand(redisClient *c) {
         if (o->encoding == REDIS_ENCODING_INT) {
             rpushLongLongValueItemNode(vlist, (long)o->ptr);
         } else {
-            rpushValueItemNode(vlist, o);
             incrRefCount(o);
+            rpushValueItemNode(vlist,o);
         }
         c->return_value = (void*)vlist;
         c->returncode = REDIS_OK;
@@ -115,10 +121,54 @@ void getCommand(redisClient *c) {
     getGenericCommand(c);
 }
 
+/* MGET key [key ...]: the reply has two nodes per key, its version (0 for
+ * a missing key) and its value, NULL when the key is missing or does not
+ * hold a string. The keys are looked up in batches, see
+ * lookupKeysReadWithVersion(). */
+void mgetCommand(redisClient *c) {
+    int j, count = c->argc-1;
+    robj **vals;
+    uint16_t *versions;
+    value_item_list* vlist;
+
+    c->returncode = REDIS_ERR;
+    vlist = createClientValueItemList(c,count*2);
+    vals = zmalloc(sizeof(robj*)*count);
+    versions = zmalloc(sizeof(uint16_t)*count);
+    if (vlist == NULL || vals == NULL || versions == NULL) {
+        if (vlist) freeValueItemList(vlist);
+        zfree(vals);
+        zfree(versions);
+        c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+        return;
+    }
+    lookupKeysReadWithVersion(c->db,c->argv+1,count,vals,versions);
+    for (j = 0; j < count; j++) {
+        robj *o = vals[j];
+
+        rpushLongLongValueItemNode(vlist,versions[j]);
+        if (o == NULL || o->type != REDIS_STRING) {
+            rpushGenericValueItemNode(vlist,NULL,0,NODE_TYPE_NULL);
+        } else if (o->encoding == REDIS_ENCODING_INT) {
+            rpushLongLongValueItemNode(vlist,(long)o->ptr);
+        } else {
+            incrRefCount(o);
+            rpushValueItemNode(vlist,o);
+        }
+    }
+    zfree(vals);
+    zfree(versions);
+    c->return_value = (void*)vlist;
+    c->returncode = REDIS_OK;
+}
+
 void getsetCommand(redisClient *c) {
     if (getGenericCommand(c) == REDIS_ERR) return;
     c->argv[2] = tryObjectEncoding(c->argv[2]);
-    dbReplace(c->db,c->argv[1],c->argv[2]);
+    if (dbReplace(c->db,c->argv[1],c->argv[2]) == -1) {
+        c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+        return;
+    }
     incrRefCount(c->argv[2]);
     c->server->dirty++;
     removeExpire(c->db,c->argv[1]);
@@ -165,7 +215,11 @@ void incrDecrCommand(redisClient *c, long long init_value, long long incr) {
     value = (int32_t)value;
 
     o = createStringObjectFromLongLong(value);
-    dbSuperReplace(c->db,c->argv[1],o);
+    if (dbSuperReplace(c->db,c->argv[1],o) == -1) {
+        decrRefCount(o);
+        c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
+        return;
+    }
     c->server->dirty++;
 
     EXPIRE_OR_NOT
@@ -42,8 +42,13 @@
     }																	\
 }while(0)
 
+/* Nodes come from the zmalloc pools, so the level a node was created with
+ * has to be passed back to zslFreeNode(). */
+#define zslNodeSize(level) \
+    (sizeof(zskiplistNode)+(level)*sizeof(struct zskiplistLevel))
+
 zskiplistNode *zslCreateNode(int level, double score, robj *obj) {
-    zskiplistNode *zn = zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
+    zskiplistNode *zn = zpool_alloc(zslNodeSize(level));
     zn->score = score;
     zn->obj = obj;
     return zn;
@@ -66,19 +71,23 @@ zskiplist *zslCreate(void) {
     return zsl;
 }
 
-void zslFreeNode(zskiplistNode *node) {
+void zslFreeNode(zskiplistNode *node, int level) {
     decrRefCount(node->obj);
-    zfree(node);
+    zpool_free(node,zslNodeSize(level));
 }
 
 void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->level[0].forward, *next;
+    zskiplistNode *next[ZSKIPLIST_MAXLEVEL], *node;
+    int i, level;
 
-    zfree(zsl->header);
-    while(node) {
-        next = node->level[0].forward;
-        zslFreeNode(node);
-        node = next;
+    /* Walk every level at once: the level of a node is the number of
+     * levels whose next node it is. */
+    for (i = 0; i < zsl->level; i++) next[i] = zsl->header->level[i].forward;
+    zpool_free(zsl->header,zslNodeSize(ZSKIPLIST_MAXLEVEL));
+    while((node = next[0]) != NULL) {
+        for (level = 0; level < zsl->level && next[level] == node; level++)
+            next[level] = node->level[level].forward;
+        zslFreeNode(node,level);
     }
     zfree(zsl);
 }
@@ -145,11 +154,13 @@ zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
     return x;
 }
 
-/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
-    int i;
+/* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank.
+ * Returns the level of the unlinked node. */
+int zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
+    int i, level = 0;
     for (i = 0; i < zsl->level; i++) {
         if (update[i]->level[i].forward == x) {
+            level++;
             update[i]->level[i].span += x->level[i].span - 1;
             update[i]->level[i].forward = x->level[i].forward;
         } else {
@@ -164,6 +175,7 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
     zsl->length--;
+    return level;
 }
 
 /* Delete an element with matching score/object from the skiplist. */
@@ -184,8 +196,7 @@ int zslDelete(zskiplist *zsl, double score, robj *obj) {
      * is to find the element with both the right score and object. */
     x = x->level[0].forward;
     if (x && score == x->score && equalStringObjects(x->obj,obj)) {
-        zslDeleteNode(zsl, x, update);
-        zslFreeNode(x);
+        zslFreeNode(x,zslDeleteNode(zsl, x, update));
         return 1;
     } else {
         return 0; /* not found */
@@ -223,9 +234,9 @@ unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec range, dict *dict
     /* Delete nodes while in range. */
     while (x && (range.maxex ? x->score < range.max : x->score <= range.max)) {
         zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
+        int level = zslDeleteNode(zsl,x,update);
         dictDelete(dict,x->obj);
-        zslFreeNode(x);
+        zslFreeNode(x,level);
         removed++;
         x = next;
     }
@@ -252,9 +263,9 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
     x = x->level[0].forward;
     while (x && traversed <= end) {
         zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
+        int level = zslDeleteNode(zsl,x,update);
         dictDelete(dict,x->obj);
-        zslFreeNode(x);
+        zslFreeNode(x,level);
         removed++;
         traversed++;
         x = next;
@@ -965,7 +976,7 @@ void zrangeGenericCommand(redisClient *c, int reverse, int withscores) {
     }
 
     /* Return the result in form of a multi-bulk reply */
-    value_item_list* vlist = createValueItemList();
+    value_item_list* vlist = createClientValueItemList(c,withscores ? rangelen*2 : rangelen);
     if(vlist == NULL) {
         c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
         return;
@@ -973,8 +984,8 @@ void zrangeGenericCommand(redisClient *c, int reverse, int withscores) {
     int num = 0;
     for (j = 0; j < rangelen; j++) {
         ele = ln->obj;
-        rpushValueItemNode(vlist,ele);
         incrRefCount(ele);
+        rpushValueItemNode(vlist,ele);
         num++;
         if (withscores) {
             rpushDoubleValueItemNode(vlist,ln->score);
@@ -1089,7 +1100,7 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse, int justcount) {
      * it later */
     value_item_list* vlist = NULL;
     if (!justcount) {
-        vlist = createValueItemList();
+        vlist = createClientValueItemList(c,0);
         if(vlist == NULL) {
             c->returncode = REDIS_ERR_MEMORY_ALLOCATE_ERROR;
             return;
@@ -1128,8 +1139,8 @@ void genericZrangebyscoreCommand(redisClient *c, int reverse, int justcount) {
         /* Do our magic */
         rangelen++;
         if (!justcount) {
+            incrRefCount(ln->obj);
             rpushValueItemNode(vlist,ln->obj);
-			incrRefCount(ln->obj);
             if (withscores) {
                 rpushDoubleValueItemNode(vlist,ln->score);
             }
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timewheel.h"
+#include "zmalloc.h"
+
+/* A node due 'delta' ticks after tw->now goes to the first level whose
+ * range, TW_SLOTS slots of that level, holds delta. Nodes of an upper level
+ * slot are moved down (cascaded) when tw->now enters the slot, so when a
+ * node is due it is always found in the level 0 slot of tw->now. Nodes due
+ * further than the whole wheel are parked in the last slot it reaches and
+ * cascaded again from there. */
+#define TW_MAX_DELTA (1LL<<(TW_LEVELS*TW_BITS))
+
+/* Max ticks twPopDue() advances in a call, so that a clock jump does not
+ * stall the caller: it just catches up over the next calls. */
+#define TW_MAX_TICKS 4096
+
+timeWheel *twCreate(long long now) {
+    timeWheel *tw = zmalloc(sizeof(*tw));
+
+    memset(tw->slots,0,sizeof(tw->slots));
+    tw->now = now;
+    return tw;
+}
+
+/* Free the wheel. The nodes still linked are owned by the caller. */
+void twRelease(timeWheel *tw) {
+    zfree(tw);
+}
+
+static void _twLink(twNode **head, twNode *n) {
+    n->next = *head;
+    if (n->next) n->next->pprev = &n->next;
+    n->pprev = head;
+    *head = n;
+}
+
+static void _twInsert(timeWheel *tw, twNode *n) {
+    long long when = n->when, delta = when - tw->now;
+    int level = 0;
+
+    if (delta < 0) {
+        /* Already due */
+        when = tw->now;
+        delta = 0;
+    } else if (delta >= TW_MAX_DELTA) {
+        when = tw->now + TW_MAX_DELTA - 1;
+        delta = TW_MAX_DELTA - 1;
+    }
+    while (level < TW_LEVELS-1 && delta >= (1LL << ((level+1)*TW_BITS)))
+        level++;
+    _twLink(&tw->slots[level][(when >> (level*TW_BITS)) & TW_MASK],n);
+}
+
+void twAdd(timeWheel *tw, twNode *n) {
+    _twInsert(tw,n);
+}
+
+/* Unlink the node from its wheel, if any. */
+void twRemove(twNode *n) {
+    if (n->pprev == NULL) return;
+    *n->pprev = n->next;
+    if (n->next) n->next->pprev = n->pprev;
+    n->next = NULL;
+    n->pprev = NULL;
+}
+
+/* tw->now just entered a new level 0 round: move down the nodes of the
+ * upper level slots it entered as well. */
+static void _twCascade(timeWheel *tw) {
+    int level;
+
+    for (level = 1; level < TW_LEVELS; level++) {
+        int idx = (tw->now >> (level*TW_BITS)) & TW_MASK;
+        twNode *n = tw->slots[level][idx];
+
+        tw->slots[level][idx] = NULL;
+        while (n) {
+            twNode *next = n->next;
+
+            _twInsert(tw,n);
+            n = next;
+        }
+        if (idx != 0) break;
+    }
+}
+
+/* Unlink and return a node with 'when' <= until, advancing the wheel up to
+ * 'until' as needed. Nodes come out in tick order. NULL is returned when no
+ * node is due, or after TW_MAX_TICKS ticks were advanced in this call. */
+twNode *twPopDue(timeWheel *tw, long long until) {
+    int ticks = 0;
+
+    while (1) {
+        twNode *n = tw->slots[0][tw->now & TW_MASK];
+
+        if (n && tw->now <= until) {
+            twRemove(n);
+            return n;
+        }
+        if (tw->now >= until || ticks++ == TW_MAX_TICKS) return NULL;
+        tw->now++;
+        if ((tw->now & TW_MASK) == 0) _twCascade(tw);
+    }
+}
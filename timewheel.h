@@ -0,0 +1,30 @@
+#ifndef __TIMEWHEEL_H
+#define __TIMEWHEEL_H
+
+/* Hierarchical timing wheel: TW_LEVELS levels of TW_SLOTS slots, level l
+ * slots covering 2^(l*TW_BITS) ticks each. Nodes are embedded by the user
+ * and can be removed in O(1) without knowing where they are. */
+#define TW_BITS 6
+#define TW_SLOTS (1<<TW_BITS)
+#define TW_MASK (TW_SLOTS-1)
+#define TW_LEVELS 6
+
+typedef struct twNode {
+    struct twNode *next;
+    struct twNode **pprev;  /* NULL when not in a wheel */
+    long long when;         /* tick the node is due at */
+    void *data;
+} twNode;
+
+typedef struct timeWheel {
+    long long now;          /* every node due up to now is in level 0 */
+    twNode *slots[TW_LEVELS][TW_SLOTS];
+} timeWheel;
+
+timeWheel *twCreate(long long now);
+void twRelease(timeWheel *tw);
+void twAdd(timeWheel *tw, twNode *n);
+void twRemove(twNode *n);
+twNode *twPopDue(timeWheel *tw, long long until);
+
+#endif // __TIMEWHEEL_H
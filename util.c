@@ -253,3 +253,17 @@ long long ustime(void) {
     ust += tv.tv_usec;
     return ust;
 }
+
+/* Return the UNIX time in milliseconds */
+long long mstime(void) {
+    return ustime()/1000;
+}
+
+/* Return a monotonic time in milliseconds, unaffected by wall clock jumps.
+ * Only differences between two values make sense. */
+long long monotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
@@ -1,5 +1,312 @@
 #include "redis.h"
 
+/*-----------------------------------------------------------------------------
+ * Reply arena
+ *----------------------------------------------------------------------------*/
+
+#define ARENA_ALIGN(_n) (((_n)+sizeof(long)-1)&~(sizeof(long)-1))
+
+/* The arena and its blocks are kept across commands, so they never come
+ * from the arena of a db (see zmalloc_arena_create()), that could be
+ * reset meanwhile. Same for the flat buffers. */
+value_item_arena* createValueItemArena() {
+    value_item_arena *arena;
+
+    zmalloc_arena_suspend();
+    arena = zmalloc(sizeof(*arena));
+    zmalloc_arena_resume();
+    arena->head = NULL;
+    arena->cur = NULL;
+    arena->total = 0;
+    arena->lists = 0;
+    return arena;
+}
+
+static void freeValueItemArenaBlocks(value_item_arena* arena) {
+    value_item_arena_block *b = arena->head, *next;
+    int dbnum = get_malloc_dbnum();
+
+    /* blocks outlive the command that allocated them, give the memory
+     * back to the namespace it was charged to */
+    while(b != NULL) {
+        next = b->next;
+        set_malloc_dbnum(b->dbnum);
+        zfree(b);
+        b = next;
+    }
+    set_malloc_dbnum(dbnum);
+    arena->head = NULL;
+    arena->cur = NULL;
+    arena->total = 0;
+}
+
+void freeValueItemArena(value_item_arena* arena) {
+    if(arena == NULL) return;
+    freeValueItemArenaBlocks(arena);
+    zfree(arena);
+}
+
+/* Rewind the arena so that the next reply reuses the same blocks. This is
+ * O(1): blocks after the first are rewound lazily when the allocator moves
+ * into them. An arena that grew past REDIS_REPLY_ARENA_MAX_BYTES because of
+ * a huge reply gives its memory back instead. */
+void resetValueItemArena(value_item_arena* arena) {
+    if(arena == NULL) return;
+    if(arena->total > REDIS_REPLY_ARENA_MAX_BYTES) {
+        freeValueItemArenaBlocks(arena);
+        return;
+    }
+    arena->cur = arena->head;
+    if(arena->head != NULL) arena->head->used = 0;
+}
+
+/* Return a block with at least 'size' free bytes, making it the current
+ * one. Blocks are chained in allocation order and never shrink, every new
+ * block is at least as large as all the previous ones together. */
+static value_item_arena_block* arenaBlockFor(value_item_arena* arena, size_t size) {
+    value_item_arena_block *b = arena->cur, *last = NULL;
+    size_t bsize;
+
+    while(b != NULL && b->used + size > b->size) {
+        last = b;
+        b = b->next;
+        if(b != NULL) b->used = 0;
+    }
+    if(b == NULL) {
+        bsize = REDIS_REPLY_ARENA_BLOCK_BYTES;
+        if(bsize < arena->total) bsize = arena->total;
+        if(bsize < size) bsize = size;
+        zmalloc_arena_suspend();
+        b = zmalloc(sizeof(*b)+bsize);
+        zmalloc_arena_resume();
+        b->next = NULL;
+        b->size = bsize;
+        b->used = 0;
+        b->dbnum = get_malloc_dbnum();
+        if(last != NULL) {
+            last->next = b;
+        } else {
+            arena->head = b;
+        }
+        arena->total += bsize;
+    }
+    arena->cur = b;
+    return b;
+}
+
+void* allocValueItemArena(value_item_arena* arena, size_t size) {
+    value_item_arena_block *b;
+    void *ptr;
+
+    size = ARENA_ALIGN(size);
+    b = arenaBlockFor(arena,size);
+    ptr = b->buf + b->used;
+    b->used += size;
+    return ptr;
+}
+
+/* Make sure the next 'size' bytes can be carved from a single block, used
+ * by commands that know the length of the reply in advance. */
+int reserveValueItemArena(value_item_arena* arena, size_t size) {
+    arenaBlockFor(arena,ARENA_ALIGN(size));
+    return REDIS_OK;
+}
+
+/*-----------------------------------------------------------------------------
+ * Flat reply
+ *----------------------------------------------------------------------------*/
+
+static value_item_flat* createValueItemFlat(uint32_t hint) {
+    value_item_flat *flat;
+
+    zmalloc_arena_suspend();
+    flat = zmalloc(sizeof(*flat));
+    flat->first = 0;
+    flat->count = 0;
+    flat->cap = hint;
+    flat->records = hint ? zmalloc(sizeof(value_item_record)*hint) : NULL;
+    zmalloc_arena_resume();
+    flat->bytes = NULL;
+    flat->used = 0;
+    flat->size = 0;
+    flat->cached = 0;
+    flat->busy = 1;
+    flat->dbnum = get_malloc_dbnum();
+    return flat;
+}
+
+static void freeValueItemFlatBuffers(value_item_flat* flat) {
+    int dbnum = get_malloc_dbnum();
+    set_malloc_dbnum(flat->dbnum);
+    zfree(flat->records);
+    zfree(flat->bytes);
+    set_malloc_dbnum(dbnum);
+    flat->records = NULL;
+    flat->bytes = NULL;
+    flat->cap = 0;
+    flat->size = 0;
+}
+
+void freeValueItemFlat(value_item_flat* flat) {
+    int dbnum;
+
+    if(flat == NULL) return;
+    freeValueItemFlatBuffers(flat);
+    dbnum = get_malloc_dbnum();
+    set_malloc_dbnum(flat->dbnum);
+    zfree(flat);
+    set_malloc_dbnum(dbnum);
+}
+
+value_item_flat* getValueItemFlat(value_item_list* list) {
+    return list == NULL ? NULL : list->flat;
+}
+
+/* Grow records or bytes, charging the namespace the buffers already
+ * belong to, so that a cached flat reply can move between dbs. */
+static void flatGrow(value_item_flat* flat, uint32_t records, size_t bytes) {
+    int dbnum = get_malloc_dbnum();
+    set_malloc_dbnum(flat->dbnum);
+    zmalloc_arena_suspend();
+    if(records > flat->cap) {
+        uint32_t cap = flat->cap ? flat->cap*2 : 16;
+        if(cap < records) cap = records;
+        flat->records = zrealloc(flat->records,sizeof(value_item_record)*cap);
+        flat->cap = cap;
+    }
+    if(bytes > flat->size) {
+        size_t size = flat->size ? flat->size*2 : REDIS_REPLY_ARENA_BLOCK_BYTES;
+        if(size < bytes) size = bytes;
+        flat->bytes = zrealloc(flat->bytes,size);
+        flat->size = size;
+    }
+    zmalloc_arena_resume();
+    set_malloc_dbnum(dbnum);
+}
+
+/* Return a free record at the tail or at the head of the reply. */
+static value_item_record* flatNewRecord(value_item_flat* flat, int where) {
+    if(where == REDIS_HEAD) {
+        if(flat->first == 0) {
+            flatGrow(flat,flat->count+1,0);
+            memmove(flat->records+1,flat->records,
+                    sizeof(value_item_record)*flat->count);
+            flat->count++;
+        } else {
+            flat->first--;
+        }
+        return flat->records+flat->first;
+    }
+    flatGrow(flat,flat->count+1,0);
+    return flat->records+(flat->count++);
+}
+
+static void flatInline(value_item_flat* flat, value_item_record* rec, void* buf, uint32_t size) {
+    size_t offset = flat->used;
+
+    flatGrow(flat,0,flat->used+size);
+    if(size) memcpy(flat->bytes+offset,buf,size);
+    flat->used += size;
+    rec->type = NODE_TYPE_BUFFER;
+    rec->inlined = 1;
+    rec->size = size;
+    rec->u.offset = offset;
+}
+
+/* Append an element to a flat reply. Robj elements are taken over: short
+ * strings and integers are copied and the reference is dropped at once,
+ * anything else keeps its reference until the reply is freed. */
+static int flatPushGeneric(value_item_list* list, void* obj, uint32_t size, int type, int where) {
+    value_item_flat *flat = list->flat;
+    value_item_record *rec = flatNewRecord(flat,where);
+
+    rec->inlined = 0;
+    rec->size = size;
+    rec->type = type;
+    rec->u.obj = NULL;
+    if(type == NODE_TYPE_ROBJ) {
+        robj *o = obj;
+        if(o->encoding == REDIS_ENCODING_INT) {
+            rec->type = NODE_TYPE_LONGLONG;
+            rec->size = 0;
+            rec->u.llnum = (long)o->ptr;
+            decrRefCount(o);
+        } else if(sdslen(o->ptr) <= REDIS_REPLY_FLAT_INLINE_MAX) {
+            flatInline(flat,rec,o->ptr,sdslen(o->ptr));
+            decrRefCount(o);
+        } else {
+            rec->u.obj = o;
+        }
+    } else if(type == NODE_TYPE_BUFFER) {
+        /* ziplist and zipmap memory may move as soon as the key is
+         * modified, copy it unless the reply pins the container */
+        if(list->pin != NULL && size > REDIS_REPLY_FLAT_INLINE_MAX) {
+            rec->u.obj = obj;
+        } else {
+            flatInline(flat,rec,obj,size);
+        }
+    } else if(type == NODE_TYPE_LONGLONG) {
+        rec->u.llnum = (long long)obj;
+    }
+    list->len++;
+    return list->len;
+}
+
+static int flatPushNumber(value_item_list* list, int type, double dnum, long long llnum, int where) {
+    value_item_record *rec = flatNewRecord(list->flat,where);
+
+    rec->type = type;
+    rec->inlined = 0;
+    rec->size = 0;
+    if(type == NODE_TYPE_DOUBLE) {
+        rec->u.dnum = dnum;
+    } else {
+        rec->u.llnum = llnum;
+    }
+    list->len++;
+    return list->len;
+}
+
+/* Compatibility adapter: turn a record into a value_item_node. */
+static void flatRecordToNode(value_item_flat* flat, value_item_record* rec, value_item_node* node) {
+    node->pre = NULL;
+    node->next = NULL;
+    node->type = rec->type;
+    node->size = rec->size;
+    if(rec->type == NODE_TYPE_DOUBLE) {
+        node->obj.dnum = rec->u.dnum;
+    } else if(rec->type == NODE_TYPE_LONGLONG) {
+        node->obj.llnum = rec->u.llnum;
+    } else {
+        node->obj.obj = valueItemRecordPtr(flat,rec);
+    }
+}
+
+/* Release the references held by a flat reply, and either keep the
+ * buffers for the next reply of the client or free them. */
+static void releaseValueItemFlat(value_item_flat* flat) {
+    uint32_t j;
+
+    for(j = flat->first; j < flat->count; j++) {
+        if(flat->records[j].type == NODE_TYPE_ROBJ && !flat->records[j].inlined)
+            decrRefCount(flat->records[j].u.obj);
+    }
+    if(!flat->cached) {
+        freeValueItemFlat(flat);
+        return;
+    }
+    if(flat->cap*sizeof(value_item_record)+flat->size > REDIS_REPLY_ARENA_MAX_BYTES)
+        freeValueItemFlatBuffers(flat);
+    flat->first = 0;
+    flat->count = 0;
+    flat->used = 0;
+    flat->busy = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Value item list
+ *----------------------------------------------------------------------------*/
+
 value_item_list* createValueItemList() {
     struct value_item_list *list;
     list = zmalloc(sizeof(*list));
@@ -9,12 +316,67 @@ value_item_list* createValueItemList() {
     list->head = NULL;
     list->tail = NULL;
     list->len = 0;
+    list->arena = NULL;
+    list->flat = NULL;
+    list->pin = NULL;
+    list->pin_dbnum = 0;
+    list->db = NULL;
+    return list;
+}
+
+/* Create a reply list whose header and nodes live in the client arena.
+ * 'hint' is the expected number of nodes, 0 when unknown. When the client
+ * asked for REDIS_REPLY_FLAT the elements go to a value_item_flat instead,
+ * reusing the one cached in the client when it is not busy. */
+value_item_list* createClientValueItemList(redisClient* c, uint32_t hint) {
+    struct value_item_list *list;
+    value_item_arena *arena;
+    value_item_flat *flat = NULL;
+
+    if(c->reply_arena == NULL) {
+        c->reply_arena = createValueItemArena();
+    }
+    arena = c->reply_arena;
+    if(c->reply_mode == REDIS_REPLY_FLAT) {
+        if(c->reply_flat == NULL) {
+            c->reply_flat = flat = createValueItemFlat(hint);
+            flat->cached = 1;
+        } else if(c->reply_flat->busy) {
+            flat = createValueItemFlat(hint);
+        } else {
+            flat = c->reply_flat;
+            flat->busy = 1;
+            flatGrow(flat,hint,0);
+        }
+        hint = 0;
+    }
+    if(hint > 0) {
+        reserveValueItemArena(arena,
+                ARENA_ALIGN(sizeof(*list))+(size_t)hint*ARENA_ALIGN(sizeof(value_item_node)));
+    }
+    list = allocValueItemArena(arena,sizeof(*list));
+    list->head = NULL;
+    list->tail = NULL;
+    list->len = 0;
+    list->arena = arena;
+    list->flat = flat;
+    list->pin = NULL;
+    list->pin_dbnum = 0;
+    /* the reply may hold elements or a pin of the db, see dropDb */
+    list->db = c->db;
+    c->db->replies++;
+    arena->lists++;
     return list;
 }
 
 void freeValueItemList(value_item_list* list) {
     value_item_node* tmp = NULL;
     if(list != NULL) {
+        if(list->flat != NULL) {
+            releaseValueItemFlat(list->flat);
+            list->flat = NULL;
+            list->len = 0;
+        }
         while(list->head != NULL) {
             tmp = list->head->next;
             freeValueItemNode(list->head);
@@ -24,44 +386,87 @@ void freeValueItemList(value_item_list* list) {
         //assert(list->len == 0);
         list->head = NULL;
         list->tail = NULL;
-        zfree(list);
+        if(list->pin != NULL) {
+            int dbnum = get_malloc_dbnum();
+            set_malloc_dbnum(list->pin_dbnum);
+            decrRefCount(list->pin);
+            set_malloc_dbnum(dbnum);
+            list->pin = NULL;
+        }
+        if(list->db != NULL) {
+            list->db->replies--;
+            list->db = NULL;
+        }
+        if(list->arena != NULL) {
+            /* the header lives in the arena, rewind it when the last
+             * list carved from it goes away */
+            if(--list->arena->lists == 0) {
+                resetValueItemArena(list->arena);
+            }
+        } else {
+            zfree(list);
+        }
         list = NULL;
     }
 }
 
-value_item_node* createDoubleValueItemNode(double score) {
-    value_item_node* node = (value_item_node*)zmalloc(sizeof(value_item_node));
+/* Keep 'o' alive as long as the list, so that BUFFER nodes can point
+ * straight into its ziplist or zipmap instead of copying the bytes. Writers
+ * get a private copy of a pinned value, see lookupKeyWriteInPlaceWithVersion. */
+void pinValueItemList(value_item_list* list, robj* o) {
+    if(list == NULL || list->pin == o) return;
+    redisAssert(list->pin == NULL);
+    incrRefCount(o);
+    list->pin = o;
+    list->pin_dbnum = get_malloc_dbnum();
+}
+
+static value_item_node* allocValueItemNode(value_item_arena* arena) {
+    value_item_node* node;
+    if(arena != NULL) {
+        node = (value_item_node*)allocValueItemArena(arena,sizeof(value_item_node));
+        node->arena = 1;
+    } else {
+        node = (value_item_node*)zpool_alloc(sizeof(value_item_node));
+        if(node == NULL) {
+            return NULL;
+        }
+        node->arena = 0;
+    }
+    node->pre = NULL;
+    node->next = NULL;
+    return node;
+}
+
+static value_item_node* _createDoubleValueItemNode(value_item_arena* arena, double score) {
+    value_item_node* node = allocValueItemNode(arena);
     if(node == NULL) {
         return NULL;
     }
 
     node->size = 0;
     node->obj.dnum = score;
-    node->pre = NULL;
-    node->next = NULL;
     node->type = NODE_TYPE_DOUBLE;
 
     return node;
 }
 
-value_item_node* createLongLongValueItemNode(long long llnum) {
-    value_item_node* node = (value_item_node*)zmalloc(sizeof(value_item_node));
+static value_item_node* _createLongLongValueItemNode(value_item_arena* arena, long long llnum) {
+    value_item_node* node = allocValueItemNode(arena);
     if(node == NULL) {
         return NULL;
     }
 
     node->size = 0;
     node->obj.llnum = llnum;
-    node->pre = NULL;
-    node->next = NULL;
     node->type = NODE_TYPE_LONGLONG;
 
     return node;
 }
 
-value_item_node* createGenericValueItemNode(void* buffer,uint32_t size,int type) {
+static value_item_node* _createGenericValueItemNode(value_item_arena* arena, void* buffer,uint32_t size,int type) {
     /* Notes: double type don't use it */
-    value_item_node* node = (value_item_node*)zmalloc(sizeof(value_item_node));
+    value_item_node* node = allocValueItemNode(arena);
     if(node == NULL) {
         return NULL;
     }
@@ -72,15 +477,27 @@ value_item_node* createGenericValueItemNode(void* buffer,uint32_t size,int type)
         node->obj.obj = buffer;
     } else if(type == NODE_TYPE_LONGLONG) {
         node->obj.llnum = (long long)buffer;
+    } else {
+        node->obj.obj = NULL;
     }
 
-    node->pre = NULL;
-    node->next = NULL;
     node->type = type;
 
     return node;
 }
 
+value_item_node* createDoubleValueItemNode(double score) {
+    return _createDoubleValueItemNode(NULL,score);
+}
+
+value_item_node* createLongLongValueItemNode(long long llnum) {
+    return _createLongLongValueItemNode(NULL,llnum);
+}
+
+value_item_node* createGenericValueItemNode(void* buffer,uint32_t size,int type) {
+    return _createGenericValueItemNode(NULL,buffer,size,type);
+}
+
 value_item_node* createValueItemNode(robj* obj) {
     //Note: here no copy
     return createGenericValueItemNode((void*)obj,0,NODE_TYPE_ROBJ);
@@ -100,7 +517,7 @@ void freeValueItemNode(value_item_node* node) {
         }
         node->pre = NULL;
         node->next = NULL;
-        zfree(node);
+        if(!node->arena) zpool_free(node,sizeof(value_item_node));
         node = NULL;
     }
 }
@@ -113,8 +530,11 @@ int rpushDoubleValueItemNode(value_item_list* list,double score) {
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushNumber(list,NODE_TYPE_DOUBLE,score,0,REDIS_TAIL);
+    }
     
-    value_item_node* node = createDoubleValueItemNode(score);
+    value_item_node* node = _createDoubleValueItemNode(list->arena,score);
     if(node == NULL) {
         return list->len;
     }
@@ -134,8 +554,11 @@ int rpushLongLongValueItemNode(value_item_list* list,long long llnum) {
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushNumber(list,NODE_TYPE_LONGLONG,0,llnum,REDIS_TAIL);
+    }
     
-    value_item_node* node = createLongLongValueItemNode(llnum);
+    value_item_node* node = _createLongLongValueItemNode(list->arena,llnum);
     if(node == NULL) {
         return list->len;
     }
@@ -155,8 +578,11 @@ int rpushGenericValueItemNode(value_item_list* list,void* obj,uint32_t size,int
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushGeneric(list,obj,size,type,REDIS_TAIL);
+    }
     
-    value_item_node* node = createGenericValueItemNode(obj,size,type);
+    value_item_node* node = _createGenericValueItemNode(list->arena,obj,size,type);
     if(node == NULL) {
         return list->len;
     }
@@ -172,12 +598,37 @@ int rpushGenericValueItemNode(value_item_list* list,void* obj,uint32_t size,int
     return list->len;
 }
 
+/* Append a copy of 'buf', for bytes that won't outlive the command, like
+ * elements popped from a ziplist. The copy goes to the flat reply or the
+ * client arena, a list with neither gets a string object. */
+int rpushBufferCopyValueItemNode(value_item_list* list,void* buf,uint32_t size) {
+    void *copy;
+
+    if(list == NULL) {
+        return 0;
+    }
+    if(list->flat != NULL) {
+        flatInline(list->flat,flatNewRecord(list->flat,REDIS_TAIL),buf,size);
+        list->len++;
+        return list->len;
+    }
+    if(list->arena == NULL) {
+        return rpushValueItemNode(list,createStringObject(buf,size,0,0));
+    }
+    copy = allocValueItemArena(list->arena,size);
+    if(size) memcpy(copy,buf,size);
+    return rpushGenericValueItemNode(list,copy,size,NODE_TYPE_BUFFER);
+}
+
 int lpushDoubleValueItemNode(value_item_list* list,double score) {
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushNumber(list,NODE_TYPE_DOUBLE,score,0,REDIS_HEAD);
+    }
 
-    value_item_node* node = createDoubleValueItemNode(score);
+    value_item_node* node = _createDoubleValueItemNode(list->arena,score);
     if(node == NULL) {
         return list->len;
     }
@@ -197,8 +648,11 @@ int lpushLongLongValueItemNode(value_item_list* list,long long llnum) {
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushNumber(list,NODE_TYPE_LONGLONG,0,llnum,REDIS_HEAD);
+    }
 
-    value_item_node* node = createDoubleValueItemNode(llnum);
+    value_item_node* node = _createLongLongValueItemNode(list->arena,llnum);
     if(node == NULL) {
         return list->len;
     }
@@ -218,8 +672,11 @@ int lpushGenericValueItemNode(value_item_list* list,void* obj,uint32_t size,int
     if(list == NULL) {
         return 0;
     }
+    if(list->flat != NULL) {
+        return flatPushGeneric(list,obj,size,type,REDIS_HEAD);
+    }
 
-    value_item_node* node = createGenericValueItemNode(obj,size,type);
+    value_item_node* node = _createGenericValueItemNode(list->arena,obj,size,type);
     if(node == NULL) {
         return list->len;
     }
@@ -253,40 +710,89 @@ void removeValueItemNode(value_item_node* node) {
     }
 }
 
+/* Popping from a flat reply hands out a standalone node that owns what
+ * the record owned; inlined bytes stay valid until the list is freed. */
+static value_item_node* flatPopNode(value_item_list* list, int where) {
+    value_item_flat *flat = list->flat;
+    value_item_record *rec;
+    value_item_node *node;
+
+    if(flat->count == flat->first) return NULL;
+    rec = (where == REDIS_HEAD) ? flat->records+(flat->first++) :
+                                  flat->records+(--flat->count);
+    node = allocValueItemNode(NULL);
+    flatRecordToNode(flat,rec,node);
+    list->len--;
+    return node;
+}
+
+/* A node carved from the client arena dies with its list: the caller gets
+ * a heap copy that takes over what the node owned. */
+static value_item_node* detachValueItemNode(value_item_node* node) {
+    value_item_node* copy;
+
+    if(node == NULL || !node->arena) {
+        return node;
+    }
+    copy = allocValueItemNode(NULL);
+    copy->type = node->type;
+    copy->size = node->size;
+    copy->obj = node->obj;
+    return copy;
+}
+
 value_item_node* lpopValueItemNode(value_item_list* list) {
     if(list == NULL) {
         return NULL;
     }
+    if(list->flat != NULL) {
+        return flatPopNode(list,REDIS_HEAD);
+    }
 
     removeValueItemNode(list->head);
     value_item_node* node = list->head;
     list->head = list->head->next;
     list->len--;
-    return node;
+    return detachValueItemNode(node);
 }
 
 value_item_node* rpopValueItemNode(value_item_list* list) {
     if(list == NULL) {
         return NULL;
     }
+    if(list->flat != NULL) {
+        return flatPopNode(list,REDIS_TAIL);
+    }
 
     removeValueItemNode(list->tail);
     value_item_node* node = list->tail;
     list->tail = list->tail->pre;
-    return node;
+    return detachValueItemNode(node);
 }
 
 value_item_iterator* createValueItemIterator(value_item_list* list) {
-    if(list == NULL || list->head == NULL) {
+    if(list == NULL || (list->head == NULL && list->len == 0)) {
         return NULL;
     }
     value_item_iterator* it = (value_item_iterator*)zmalloc(sizeof(value_item_iterator));
     it->next = list->head;
     it->now = 0;
+    it->flat = list->flat;
+    it->node.arena = 1;
     return it;
 }
 
 value_item_node* nextValueItemNode(value_item_iterator** it) {
+    if((*it)->flat != NULL) {
+        value_item_flat* flat = (*it)->flat;
+        uint32_t idx = flat->first + (*it)->now;
+        if(idx >= flat->count) {
+            return NULL;
+        }
+        flatRecordToNode(flat,flat->records+idx,&(*it)->node);
+        (*it)->now++;
+        return &(*it)->node;
+    }
     if((*it)->next == NULL) {
         return NULL;
     }
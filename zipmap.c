@@ -360,6 +360,13 @@ unsigned int zipmapLen(unsigned char *zm) {
     return len;
 }
 
+/* Return the raw size in bytes of a zipmap, so that it can be copied. */
+unsigned int zipmapBlobLen(unsigned char *zm) {
+    unsigned int totlen;
+    zipmapLookupRaw(zm,NULL,0,&totlen);
+    return totlen;
+}
+
 void zipmapRepr(unsigned char *p) {
     unsigned int l;
 
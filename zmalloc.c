@@ -28,11 +28,15 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "config.h"
 #include "zmalloc.h"
 
@@ -46,6 +50,29 @@
 #endif
 #endif
 
+/* Db arenas need the PREFIX_SIZE header to tell their allocations apart,
+ * with room for the db in its high bits. See zmalloc_arena_create(). */
+#if !defined(HAVE_MALLOC_SIZE) && SIZE_MAX > 0xffffffffUL
+#define ZMALLOC_ARENAS 1
+#define ZARENA_TAG_SHIFT 48
+#define ZARENA_SIZE_MASK (((size_t)1<<ZARENA_TAG_SHIFT)-1)
+#define zarena_tag_db(hdr) ((int)((hdr) >> ZARENA_TAG_SHIFT)-1)
+
+typedef struct zarena zarena;
+static int zarena_count = 0;
+static zarena *zarena_current(void);
+static void *zarena_alloc(zarena *a, size_t size);
+static void zarena_free(int db, void *ptr, size_t size);
+static void *zarena_zmalloc(zarena *a, size_t size);
+static void *zarena_zrealloc(void *ptr, size_t size);
+static void zarena_zfree(void *ptr);
+
+/* Flag of the PREFIX_SIZE header of zcalloc_huge() blocks, below the
+ * arena tag. */
+#define ZMALLOC_HUGE ((size_t)1<<47)
+static void zfree_huge(void *ptr, size_t size);
+#endif
+
 /* Explicitly override malloc/free etc when using tcmalloc. */
 #if defined(USE_TCMALLOC)
 #define malloc(size) tc_malloc(size)
@@ -54,14 +81,28 @@
 #define free(ptr) tc_free(ptr)
 #endif
 
+/* In thread safe mode every thread accumulates its allocations in a
+ * private delta, published to the shared counters only when it grows past
+ * ZMALLOC_STAT_BATCH bytes or the thread switches db. So the counters are
+ * exact only within ZMALLOC_STAT_BATCH bytes per allocating thread, but no
+ * lock is taken on the allocation path and reading them is a plain load. */
+#define ZMALLOC_STAT_BATCH (1024*32)
+
+#ifdef HAVE_ATOMIC
+#define zmalloc_stat_add(__var,__n) __sync_add_and_fetch(&(__var),(__n))
+#else
+#define zmalloc_stat_add(__var,__n) do { \
+    pthread_mutex_lock(&used_memory_mutex); \
+    (__var) += (__n); \
+    pthread_mutex_unlock(&used_memory_mutex); \
+} while(0)
+#endif
+
 #define update_zmalloc_stat_alloc(__dbnum,__n,__size) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        db_used_memory[__dbnum] += _n;            \
-        used_memory += _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
+        zmalloc_stat_update(__dbnum,(long)_n); \
     } else { \
         used_memory += _n; \
     } \
@@ -71,10 +112,7 @@
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
     if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        db_used_memory[__dbnum] -= _n;            \
-        used_memory -= _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
+        zmalloc_stat_update(__dbnum,-(long)_n); \
     } else { \
         used_memory -= _n; \
     } \
@@ -87,6 +125,44 @@ static __thread int dbnum;
 
 static size_t db_used_memory[MAX_DBNUM];
 
+static pthread_key_t stat_key;
+static __thread int stat_db = -1;   /* db the pending delta is charged to */
+static __thread long stat_delta = 0;
+
+static void zmalloc_stat_flush(void) {
+    if (stat_delta == 0) return;
+    zmalloc_stat_add(used_memory,(size_t)stat_delta);
+    zmalloc_stat_add(db_used_memory[stat_db],(size_t)stat_delta);
+    stat_delta = 0;
+}
+
+static void zpool_thread_exit(void);
+
+/* Publish what is left when an allocating thread exits. */
+static void zmalloc_stat_thread_exit(void *arg) {
+    (void)arg;
+    zpool_thread_exit();
+    zmalloc_stat_flush();
+}
+
+static inline void zmalloc_stat_update(int db, long n) {
+    if (db != stat_db) {
+        if (stat_db == -1) pthread_setspecific(stat_key,(void*)1);
+        zmalloc_stat_flush();
+        stat_db = db;
+    }
+    stat_delta += n;
+    if (stat_delta > ZMALLOC_STAT_BATCH || stat_delta < -ZMALLOC_STAT_BATCH)
+        zmalloc_stat_flush();
+}
+
+/* Deltas of different threads are published independently, so a counter
+ * may briefly read below zero; clamp it. */
+static size_t zmalloc_stat_read(size_t *var) {
+    size_t um = *(volatile size_t *)var;
+    return ((long)um < 0) ? 0 : um;
+}
+
 void init_db_used_memory() {
     bzero((void *)db_used_memory, sizeof(db_used_memory));
 }
@@ -108,7 +184,13 @@ static void zmalloc_oom(size_t size) {
 }
 
 void *zmalloc(size_t size) {
-    void *ptr = malloc(size+PREFIX_SIZE);
+    void *ptr;
+#ifdef ZMALLOC_ARENAS
+    zarena *a = zarena_current();
+
+    if (a) return zarena_zmalloc(a,size);
+#endif
+    ptr = malloc(size+PREFIX_SIZE);
 
     if (!ptr) zmalloc_oom(size);
 #ifdef HAVE_MALLOC_SIZE
@@ -122,7 +204,13 @@ void *zmalloc(size_t size) {
 }
 
 void *redis_zcalloc(size_t size) {
-    void *ptr = calloc(1, size+PREFIX_SIZE);
+    void *ptr;
+#ifdef ZMALLOC_ARENAS
+    zarena *a = zarena_current();
+
+    if (a) return memset(zarena_zmalloc(a,size),0,size);
+#endif
+    ptr = calloc(1, size+PREFIX_SIZE);
 
     if (!ptr) zmalloc_oom(size);
 #ifdef HAVE_MALLOC_SIZE
@@ -143,6 +231,21 @@ void *zrealloc(void *ptr, size_t size) {
     void *newptr;
 
     if (ptr == NULL) return zmalloc(size);
+#ifdef ZMALLOC_HUGE
+    oldsize = *((size_t*)((char*)ptr-PREFIX_SIZE));
+    if (oldsize & ZMALLOC_HUGE) {
+        oldsize &= ~ZMALLOC_HUGE;
+        newptr = zmalloc(size);
+        memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+        zfree(ptr);
+        return newptr;
+    }
+#endif
+#ifdef ZMALLOC_ARENAS
+    if ((*((size_t*)((char*)ptr-PREFIX_SIZE)) >> ZARENA_TAG_SHIFT) ||
+        zarena_current())
+        return zarena_zrealloc(ptr,size);
+#endif
 #ifdef HAVE_MALLOC_SIZE
     oldsize = redis_malloc_size(ptr);
     newptr = realloc(ptr,size);
@@ -177,11 +280,89 @@ void zfree(void *ptr) {
 #else
     realptr = (char*)ptr-PREFIX_SIZE;
     oldsize = *((size_t*)realptr);
+#ifdef ZMALLOC_ARENAS
+    if (oldsize >> ZARENA_TAG_SHIFT) {
+        zarena_zfree(ptr);
+        return;
+    }
+#endif
+#ifdef ZMALLOC_HUGE
+    if (oldsize & ZMALLOC_HUGE) {
+        zfree_huge(ptr,oldsize & ~ZMALLOC_HUGE);
+        return;
+    }
+#endif
     update_zmalloc_stat_free(dbnum,oldsize+PREFIX_SIZE);
     free(realptr);
 #endif
 }
 
+/* Huge zeroed blocks, as the bucket arrays of big hash tables. They are
+ * mapped straight from the kernel, so they cost no memory until touched
+ * and no time to zero, and zmalloc_release_range() can give back the pages
+ * of a part the caller is done with while the rest is still in use. The
+ * block is preceded by a page holding the usual size prefix, flagged with
+ * ZMALLOC_HUGE, so zfree() unmaps it. Blocks below ZMALLOC_HUGE_SIZE, and
+ * blocks of a db with an arena (freed in bulk with it), are plain
+ * redis_zcalloc() ones, and so are all of them without a size prefix. */
+#ifdef ZMALLOC_HUGE
+#define ZMALLOC_HUGE_SIZE (1024*1024)
+
+static size_t zmalloc_page_size(void) {
+    static size_t page = 0;
+
+    if (page == 0) page = (size_t)sysconf(_SC_PAGESIZE);
+    return page;
+}
+
+void *zcalloc_huge(size_t size) {
+    size_t page = zmalloc_page_size();
+    size_t len;
+    char *base;
+
+    if (size < ZMALLOC_HUGE_SIZE) return redis_zcalloc(size);
+#ifdef ZMALLOC_ARENAS
+    if (zarena_current()) return redis_zcalloc(size);
+#endif
+    len = page+(size+page-1)/page*page;
+    base = mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (base == MAP_FAILED) zmalloc_oom(size);
+    *((size_t*)(base+page-PREFIX_SIZE)) = size|ZMALLOC_HUGE;
+    update_zmalloc_stat_alloc(dbnum,len,size);
+    return base+page;
+}
+
+static void zfree_huge(void *ptr, size_t size) {
+    size_t page = zmalloc_page_size();
+    size_t len = page+(size+page-1)/page*page;
+
+    update_zmalloc_stat_free(dbnum,len);
+    munmap((char*)ptr-page,len);
+}
+
+/* Give back the whole pages of [offset,offset+len) of a zcalloc_huge()
+ * block: they read as zero from now on. Nothing is done for small blocks. */
+void zmalloc_release_range(void *ptr, size_t offset, size_t len) {
+    size_t page = zmalloc_page_size();
+    size_t start = (offset+page-1)/page*page;
+    size_t end = (offset+len)/page*page;
+
+    if (ptr == NULL || end <= start) return;
+    if (!(*((size_t*)((char*)ptr-PREFIX_SIZE)) & ZMALLOC_HUGE)) return;
+    madvise((char*)ptr+start,end-start,MADV_DONTNEED);
+}
+#else
+void *zcalloc_huge(size_t size) {
+    return redis_zcalloc(size);
+}
+
+void zmalloc_release_range(void *ptr, size_t offset, size_t len) {
+    (void)ptr;
+    (void)offset;
+    (void)len;
+}
+#endif
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -190,25 +371,498 @@ char *zstrdup(const char *s) {
     return p;
 }
 
-size_t zmalloc_used_memory(void) {
-    size_t um;
+/* Slab pools for small fixed size objects (robj, dictEntry, skiplist nodes,
+ * reply nodes). Objects of up to ZPOOL_MAX_SIZE bytes are carved out of
+ * ZPOOL_PAGE_SIZE aligned pages with no malloc header and no PREFIX_SIZE,
+ * one size class every 8 bytes. Each thread keeps up to ZPOOL_CACHE free
+ * slots per class and only goes to the shared pages, under zpool_mutex, to
+ * refill or drain half of its cache. A page whose slots all came back is
+ * released unless it is the last one with free slots of its class.
+ *
+ * Callers must pass to zpool_free() the same size given to zpool_alloc().
+ * Accounting is the same as zmalloc(): the slot size is charged to the
+ * current dbnum on allocation and credited to it on free. */
+#define ZPOOL_PAGE_SIZE (1024*64)
+#define ZPOOL_MAX_SIZE 128
+#define ZPOOL_CLASSES (ZPOOL_MAX_SIZE/8)
+#define ZPOOL_CACHE 32
+
+typedef struct zpool_page {
+    struct zpool_page *prev, *next;   /* pages with free slots */
+    void *free;                       /* free list of returned slots */
+    char *fresh;                      /* slots never handed out start here */
+    unsigned int used;                /* slots out of the page, cached too */
+    unsigned int slots;
+    int listed;
+    int cls;
+    int arena;                        /* db+1 for pages of a db arena */
+    struct zpool_page *anext, *aprev; /* all the pages of the arena */
+} zpool_page;
+
+typedef struct zpool_cache {
+    void *slots[ZPOOL_CACHE];
+    int count;
+} zpool_cache;
+
+static pthread_mutex_t zpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zpool_page *zpool_partial[ZPOOL_CLASSES];
+static __thread zpool_cache zpool_caches[ZPOOL_CLASSES];
+
+#define zpool_slot_size(cls) (((size_t)(cls)+1)*8)
+#define zpool_page_of(ptr) \
+    ((zpool_page*)((unsigned long)(ptr) & ~((unsigned long)ZPOOL_PAGE_SIZE-1)))
+
+static void zpool_lock(void) {
+    if (zmalloc_thread_safe) pthread_mutex_lock(&zpool_mutex);
+}
+
+static void zpool_unlock(void) {
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&zpool_mutex);
+}
+
+static void zpool_link(zpool_page **partial, zpool_page *page) {
+    page->prev = NULL;
+    page->next = partial[page->cls];
+    if (page->next) page->next->prev = page;
+    partial[page->cls] = page;
+    page->listed = 1;
+}
+
+static void zpool_unlink(zpool_page **partial, zpool_page *page) {
+    if (page->prev) page->prev->next = page->next;
+    else partial[page->cls] = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->listed = 0;
+}
+
+static zpool_page *zpool_new_page(int cls) {
+    void *mem;
+    zpool_page *page;
+
+    if (posix_memalign(&mem,ZPOOL_PAGE_SIZE,ZPOOL_PAGE_SIZE) != 0)
+        zmalloc_oom(ZPOOL_PAGE_SIZE);
+    page = mem;
+    page->free = NULL;
+    page->fresh = (char*)page+sizeof(*page);
+    page->used = 0;
+    page->slots = (ZPOOL_PAGE_SIZE-sizeof(*page))/zpool_slot_size(cls);
+    page->cls = cls;
+    page->arena = 0;
+    zpool_link(zpool_partial,page);
+    return page;
+}
+
+/* Move half a cache worth of slots from the shared pages to 'cache'. */
+static void zpool_refill(int cls, zpool_cache *cache) {
+    size_t size = zpool_slot_size(cls);
+
+    zpool_lock();
+    while (cache->count < ZPOOL_CACHE/2) {
+        zpool_page *page = zpool_partial[cls];
+        void *slot;
+
+        if (page == NULL) page = zpool_new_page(cls);
+        if (page->free) {
+            slot = page->free;
+            page->free = *(void**)slot;
+        } else {
+            slot = page->fresh;
+            page->fresh += size;
+        }
+        cache->slots[cache->count++] = slot;
+        if (++page->used == page->slots) zpool_unlink(zpool_partial,page);
+    }
+    zpool_unlock();
+}
 
-    if (zmalloc_thread_safe) pthread_mutex_lock(&used_memory_mutex);
-    um = used_memory;
-    if (zmalloc_thread_safe) pthread_mutex_unlock(&used_memory_mutex);
-    return um;
+/* Give the oldest 'n' slots of 'cache' back to their pages. */
+static void zpool_drain(zpool_cache *cache, int n) {
+    int j;
+
+    zpool_lock();
+    for (j = 0; j < n; j++) {
+        void *slot = cache->slots[j];
+        zpool_page *page = zpool_page_of(slot);
+
+        *(void**)slot = page->free;
+        page->free = slot;
+        if (!page->listed) zpool_link(zpool_partial,page);
+        if (--page->used == 0 &&
+            (page->prev != NULL || page->next != NULL))
+        {
+            zpool_unlink(zpool_partial,page);
+            free(page);
+        }
+    }
+    zpool_unlock();
+    memmove(cache->slots,cache->slots+n,sizeof(void*)*(cache->count-n));
+    cache->count -= n;
+}
+
+static void zpool_thread_exit(void) {
+    int cls;
+
+    for (cls = 0; cls < ZPOOL_CLASSES; cls++) {
+        if (zpool_caches[cls].count)
+            zpool_drain(&zpool_caches[cls],zpool_caches[cls].count);
+    }
+}
+
+void *zpool_alloc(size_t size) {
+    int cls;
+    zpool_cache *cache;
+
+    if (size == 0 || size > ZPOOL_MAX_SIZE) return zmalloc(size);
+#ifdef ZMALLOC_ARENAS
+    {
+        zarena *a = zarena_current();
+        if (a) return zarena_alloc(a,size);
+    }
+#endif
+    cls = (size-1)/8;
+    cache = &zpool_caches[cls];
+    if (cache->count == 0) zpool_refill(cls,cache);
+    update_zmalloc_stat_alloc(dbnum,zpool_slot_size(cls),size);
+    return cache->slots[--cache->count];
+}
+
+void zpool_free(void *ptr, size_t size) {
+    int cls;
+    zpool_cache *cache;
+
+    if (ptr == NULL) return;
+    if (size == 0 || size > ZPOOL_MAX_SIZE) {
+        zfree(ptr);
+        return;
+    }
+#ifdef ZMALLOC_ARENAS
+    if (zarena_count && zpool_page_of(ptr)->arena) {
+        zarena_free(zpool_page_of(ptr)->arena-1,ptr,size);
+        return;
+    }
+#endif
+    cls = (size-1)/8;
+    cache = &zpool_caches[cls];
+    update_zmalloc_stat_free(dbnum,zpool_slot_size(cls));
+    if (cache->count == ZPOOL_CACHE) zpool_drain(cache,ZPOOL_CACHE/2);
+    cache->slots[cache->count++] = ptr;
+}
+
+#ifdef ZMALLOC_ARENAS
+/* Db arenas. While the arena of a db exists, everything allocated with
+ * the malloc dbnum of that db comes from it: ZPOOL_PAGE_SIZE pages for
+ * blocks of up to ZARENA_MAX_SMALL bytes, in 36 size classes (8 bytes
+ * apart up to 128, then four per power of two), and malloc()ed blocks
+ * linked in the arena above that. So the memory of the db is known
+ * exactly, and zmalloc_arena_reset() gives it all back in bulk, without
+ * looking at what it holds.
+ *
+ * Blocks allocated by zmalloc() carry the db in the high bits of their
+ * PREFIX_SIZE header, zpool_alloc() slots in the header of their page, so
+ * they go back to their arena whatever the dbnum they are freed with.
+ * Memory not owned by the keyspace of the db (replies, client buffers)
+ * must be allocated between zmalloc_arena_suspend() and
+ * zmalloc_arena_resume(), or it would be lost in a reset. */
+#define ZARENA_MAX_SMALL 4096
+#define ZARENA_CLASSES (ZPOOL_CLASSES+20)
+
+typedef struct zarena_large {
+    struct zarena_large *prev, *next;
+    size_t size;
+} zarena_large;
+
+struct zarena {
+    pthread_mutex_t lock;
+    zpool_page *partial[ZARENA_CLASSES];
+    zpool_page *pages;
+    zarena_large *large;
+    size_t used;
+    int db;
+};
+
+static zarena *zarenas[MAX_DBNUM];
+static __thread int zarena_suspended = 0;
+
+static zarena *zarena_current(void) {
+    if (zarena_count == 0 || zarena_suspended ||
+        dbnum < 0 || dbnum >= MAX_DBNUM) return NULL;
+    return zarenas[dbnum];
+}
+
+static int zarena_class(size_t size) {
+    int b;
+
+    if (size <= ZPOOL_MAX_SIZE) return (size-1)/8;
+    b = 63-__builtin_clzl(size-1);
+    return ZPOOL_CLASSES+(b-7)*4+(int)((size-1-((size_t)1<<b))>>(b-2));
+}
+
+static size_t zarena_class_size(int cls) {
+    size_t base;
+
+    if (cls < ZPOOL_CLASSES) return zpool_slot_size(cls);
+    cls -= ZPOOL_CLASSES;
+    base = (size_t)ZPOOL_MAX_SIZE << (cls/4);
+    return base+(cls%4+1)*(base/4);
+}
+
+static void zarena_lock(zarena *a) {
+    if (zmalloc_thread_safe) pthread_mutex_lock(&a->lock);
+}
+
+static void zarena_unlock(zarena *a) {
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&a->lock);
+}
+
+static void zarena_stat(long n) {
+    if (zmalloc_thread_safe) zmalloc_stat_add(used_memory,(size_t)n);
+    else used_memory += n;
+}
+
+/* Allocate 'size' bytes from the arena */
+static void *zarena_alloc(zarena *a, size_t size) {
+    void *ptr;
+    long n;
+
+    zarena_lock(a);
+    if (size <= ZARENA_MAX_SMALL) {
+        int cls = zarena_class(size);
+        zpool_page *page = a->partial[cls];
+
+        n = zarena_class_size(cls);
+        if (page == NULL) {
+            void *mem;
+
+            if (posix_memalign(&mem,ZPOOL_PAGE_SIZE,ZPOOL_PAGE_SIZE) != 0)
+                zmalloc_oom(ZPOOL_PAGE_SIZE);
+            page = mem;
+            page->free = NULL;
+            page->fresh = (char*)page+sizeof(*page);
+            page->used = 0;
+            page->slots = (ZPOOL_PAGE_SIZE-sizeof(*page))/n;
+            page->cls = cls;
+            page->arena = a->db+1;
+            page->aprev = NULL;
+            page->anext = a->pages;
+            if (page->anext) page->anext->aprev = page;
+            a->pages = page;
+            zpool_link(a->partial,page);
+        }
+        if (page->free) {
+            ptr = page->free;
+            page->free = *(void**)ptr;
+        } else {
+            ptr = page->fresh;
+            page->fresh += n;
+        }
+        if (++page->used == page->slots) zpool_unlink(a->partial,page);
+    } else {
+        zarena_large *l = malloc(sizeof(*l)+size);
+
+        if (!l) zmalloc_oom(size);
+        n = sizeof(*l)+size;
+        l->size = n;
+        l->prev = NULL;
+        l->next = a->large;
+        if (l->next) l->next->prev = l;
+        a->large = l;
+        ptr = l+1;
+    }
+    a->used += n;
+    zarena_unlock(a);
+    zarena_stat(n);
+    return ptr;
+}
+
+/* Give back 'ptr' of 'size' bytes to the arena of 'db' */
+static void zarena_free(int db, void *ptr, size_t size) {
+    zarena *a = zarenas[db];
+    long n;
+
+    zarena_lock(a);
+    if (size <= ZARENA_MAX_SMALL) {
+        zpool_page *page = zpool_page_of(ptr);
+
+        n = zarena_class_size(page->cls);
+        *(void**)ptr = page->free;
+        page->free = ptr;
+        if (!page->listed) zpool_link(a->partial,page);
+        if (--page->used == 0 &&
+            (page->prev != NULL || page->next != NULL))
+        {
+            zpool_unlink(a->partial,page);
+            if (page->aprev) page->aprev->anext = page->anext;
+            else a->pages = page->anext;
+            if (page->anext) page->anext->aprev = page->aprev;
+            free(page);
+        }
+    } else {
+        zarena_large *l = (zarena_large*)ptr-1;
+
+        n = l->size;
+        if (l->prev) l->prev->next = l->next;
+        else a->large = l->next;
+        if (l->next) l->next->prev = l->prev;
+        free(l);
+    }
+    a->used -= n;
+    zarena_unlock(a);
+    zarena_stat(-n);
+}
+
+static void *zarena_zmalloc(zarena *a, size_t size) {
+    size_t *ptr = zarena_alloc(a,size+PREFIX_SIZE);
+
+    *ptr = size | ((size_t)(a->db+1) << ZARENA_TAG_SHIFT);
+    return (char*)ptr+PREFIX_SIZE;
+}
+
+static void zarena_zfree(void *ptr) {
+    size_t *realptr = (size_t*)((char*)ptr-PREFIX_SIZE);
+
+    zarena_free(zarena_tag_db(*realptr),realptr,
+                (*realptr & ZARENA_SIZE_MASK)+PREFIX_SIZE);
+}
+
+/* A block of an arena stays in it, a block of the heap moves to the arena
+ * of the current dbnum. */
+static void *zarena_zrealloc(void *ptr, size_t size) {
+    size_t *realptr = (size_t*)((char*)ptr-PREFIX_SIZE);
+    size_t oldsize = *realptr & ZARENA_SIZE_MASK;
+    int db = zarena_tag_db(*realptr);
+    void *newptr;
+
+    if (db >= 0) {
+        if (oldsize+PREFIX_SIZE <= ZARENA_MAX_SMALL &&
+            size+PREFIX_SIZE <= ZARENA_MAX_SMALL &&
+            zarena_class(oldsize+PREFIX_SIZE) == zarena_class(size+PREFIX_SIZE))
+        {
+            *realptr = size | ((size_t)(db+1) << ZARENA_TAG_SHIFT);
+            return ptr;
+        }
+        newptr = zarena_zmalloc(zarenas[db],size);
+    } else {
+        newptr = zmalloc(size);
+    }
+    memcpy(newptr,ptr,oldsize < size ? oldsize : size);
+    zfree(ptr);
+    return newptr;
+}
+
+static void zarena_clear(zarena *a) {
+    zpool_page *page, *nextpage;
+    zarena_large *l, *nextl;
+
+    for (page = a->pages; page; page = nextpage) {
+        nextpage = page->anext;
+        free(page);
+    }
+    for (l = a->large; l; l = nextl) {
+        nextl = l->next;
+        free(l);
+    }
+    memset(a->partial,0,sizeof(a->partial));
+    a->pages = NULL;
+    a->large = NULL;
+    zarena_stat(-(long)a->used);
+    a->used = 0;
+}
+#endif
+
+/* Create the arena of the db 'db', see above. Return -1 if arenas are not
+ * supported by this build, or the db already has one. No other thread may
+ * allocate or free while arenas are created or released. */
+int zmalloc_arena_create(int db) {
+#ifdef ZMALLOC_ARENAS
+    zarena *a;
+
+    if (db < 0 || db >= MAX_DBNUM || zarenas[db] != NULL) return -1;
+    a = calloc(1,sizeof(*a));
+    if (!a) zmalloc_oom(sizeof(*a));
+    pthread_mutex_init(&a->lock,NULL);
+    a->db = db;
+    zarenas[db] = a;
+    zarena_count++;
+    return 0;
+#else
+    (void)db;
+    return -1;
+#endif
+}
+
+/* Free at once everything allocated in the arena of 'db'. */
+void zmalloc_arena_reset(int db) {
+#ifdef ZMALLOC_ARENAS
+    zarena *a = (db >= 0 && db < MAX_DBNUM) ? zarenas[db] : NULL;
+
+    if (a == NULL) return;
+    zarena_lock(a);
+    zarena_clear(a);
+    zarena_unlock(a);
+#else
+    (void)db;
+#endif
+}
+
+/* Free the arena of 'db' and everything allocated in it. */
+void zmalloc_arena_release(int db) {
+#ifdef ZMALLOC_ARENAS
+    zarena *a = (db >= 0 && db < MAX_DBNUM) ? zarenas[db] : NULL;
+
+    if (a == NULL) return;
+    zarena_clear(a);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    zarenas[db] = NULL;
+    zarena_count--;
+#else
+    (void)db;
+#endif
+}
+
+int zmalloc_arena_enabled(int db) {
+#ifdef ZMALLOC_ARENAS
+    return db >= 0 && db < MAX_DBNUM && zarenas[db] != NULL;
+#else
+    (void)db;
+    return 0;
+#endif
+}
+
+/* Allocate from the heap until the matching zmalloc_arena_resume(), even
+ * if the current dbnum has an arena. Calls nest. */
+void zmalloc_arena_suspend(void) {
+#ifdef ZMALLOC_ARENAS
+    zarena_suspended++;
+#endif
+}
+
+void zmalloc_arena_resume(void) {
+#ifdef ZMALLOC_ARENAS
+    zarena_suspended--;
+#endif
+}
+
+size_t zmalloc_used_memory(void) {
+    if (zmalloc_thread_safe) return zmalloc_stat_read(&used_memory);
+    return used_memory;
 }
 
 size_t zmalloc_db_used_memory(int id) {
+    size_t used;
+
     if (id < 0 || id >= MAX_DBNUM) return 0;
-    size_t um;
-    if (zmalloc_thread_safe) pthread_mutex_lock(&used_memory_mutex);
-    um = db_used_memory[id];
-    if (zmalloc_thread_safe) pthread_mutex_unlock(&used_memory_mutex);
-    return um;
+    used = zmalloc_stat_read(&db_used_memory[id]);
+#ifdef ZMALLOC_ARENAS
+    /* Exact for what is in the arena */
+    if (zarenas[id]) used += zarenas[id]->used;
+#endif
+    return used;
 }
 
 void zmalloc_enable_thread_safeness(void) {
+    if (zmalloc_thread_safe) return;
+    pthread_key_create(&stat_key,zmalloc_stat_thread_exit);
     zmalloc_thread_safe = 1;
 }
 
@@ -216,6 +870,12 @@ int zmalloc_thread_safeness(void) {
     return zmalloc_thread_safe;
 }
 
+/* Publish the allocations of the calling thread not counted yet, for
+ * threads that go idle for long after freeing much memory. */
+void zmalloc_flush_stat(void) {
+    if (zmalloc_thread_safe) zmalloc_stat_flush();
+}
+
 /* Get the RSS information in an OS-specific way.
  *
  * WARNING: the function zmalloc_get_rss() is not designed to be fast
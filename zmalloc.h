@@ -36,10 +36,21 @@ void *redis_zcalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
+void *zpool_alloc(size_t size);
+void zpool_free(void *ptr, size_t size);
+void *zcalloc_huge(size_t size);
+void zmalloc_release_range(void *ptr, size_t offset, size_t len);
 size_t zmalloc_used_memory(void);
 size_t zmalloc_db_used_memory(int id);
 void zmalloc_enable_thread_safeness(void);
 int zmalloc_thread_safeness(void);
+void zmalloc_flush_stat(void);
+int zmalloc_arena_create(int db);
+void zmalloc_arena_reset(int db);
+void zmalloc_arena_release(int db);
+int zmalloc_arena_enabled(int db);
+void zmalloc_arena_suspend(void);
+void zmalloc_arena_resume(void);
 float zmalloc_get_fragmentation_ratio(void);
 size_t zmalloc_get_rss(void);
 